@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>            //termios, TCSANOW, ECHO, ICANON
@@ -9,13 +11,47 @@
 #include <fcntl.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
 
 const char* sysname = "seashell";
 
+#define PROMPT_SIZE 4096
+
 enum return_codes {
 	SUCCESS = 0,
 	EXIT = 1,
 	UNKNOWN = 2,
+	LOOP_BREAK = 3,
+	LOOP_CONTINUE = 4,
+	FUNC_RETURN = 5,
+	INTERRUPTED = 6, // Ctrl+C at the prompt
+};
+enum redirect_type {
+	REDIRECT_INPUT, // n<file
+	REDIRECT_OUTPUT, // n>file
+	REDIRECT_APPEND, // n>>file
+	REDIRECT_DUP, // n>&m, n<&m, n>&-
+	REDIRECT_STRING, // n<<<word, and here-documents
+};
+struct redirect_t {
+	enum redirect_type type;
+	int fd;
+	char* target; // file name, fd number or here-string text
 };
 struct command_t {
 	char* name;
@@ -23,7 +59,8 @@ struct command_t {
 	bool auto_complete;
 	int arg_count;
 	char** args;
-	char* redirects[3]; // in/out redirection
+	struct redirect_t* redirects; // in/out redirection, applied in order
+	int redirect_count;
 	struct command_t* next; // for piping
 };
 
@@ -38,8 +75,9 @@ void print_command(struct command_t* command)
 	printf("\tIs Background: %s\n", command->background ? "yes" : "no");
 	printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
 	printf("\tRedirects:\n");
-	for (i = 0;i < 3;i++)
-		printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
+	const char* ops[] = { "<", ">", ">>", ">&", "<<<" };
+	for (i = 0;i < command->redirect_count;i++)
+		printf("\t\t%d%s %s\n", command->redirects[i].fd, ops[command->redirects[i].type], command->redirects[i].target);
 	printf("\tArguments (%d):\n", command->arg_count);
 	for (i = 0;i < command->arg_count;++i)
 		printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -65,9 +103,9 @@ int free_command(struct command_t* command)
 			free(command->args[i]);
 		free(command->args);
 	}
-	for (int i = 0;i < 3;++i)
-		if (command->redirects[i])
-			free(command->redirects[i]);
+	for (int i = 0;i < command->redirect_count;++i)
+		free(command->redirects[i].target);
+	free(command->redirects);
 	if (command->next)
 	{
 		free_command(command->next);
@@ -85,649 +123,4353 @@ int free_command(struct command_t* command)
 int show_prompt()
 {
 	char cwd[1024], hostname[1024];
+	const char* user = getenv("USER");
 	gethostname(hostname, sizeof(hostname));
 	getcwd(cwd, sizeof(cwd));
-	printf("\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m \033[1;36m%s\033[0m\033[1;33m$\033[0m ", getenv("USER"), hostname, cwd, sysname);
-	return 0;
+	printf("\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m \033[1;36m%s\033[0m\033[1;33m$\033[0m ", user, hostname, cwd, sysname);
+	// visible width, for redrawing
+	return strlen(user ? user : "(null)") + strlen(hostname) + strlen(cwd) + strlen(sysname) + 5;
 }
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Recognize a redirection word: [n]<, [n]>, [n]>>, [n]>&m, [n]<&m, &>,
+ * &>> and [n]<<< (here-documents arrive as <<< words too). The target
+ * is the following word.
+ * @param  words     remaining words, words[0] an operator word
+ * @param  operators which of them are operators
+ * @param  remaining number of remaining words
+ * @param  command   receives the redirection
+ * @return           words consumed, 0 if words[0] is no redirection
  */
-int parse_command(char* buf, struct command_t* command)
+int parse_redirect(char** words, bool* operators, int remaining, struct command_t* command)
 {
-	const char* splitters = " \t"; // split at whitespace
-	int index, len;
-	len = strlen(buf);
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+	char* p = words[0];
+	int fd = -1;
+	bool both = false; // &> and &>>
+	enum redirect_type type;
+
+	if (p[0] == '&' && p[1] == '>')
 	{
-		buf++;
-		len--;
+		both = true;
+		p++;
+	}
+	else
+	{
+		while (isdigit((unsigned char)*p)) p++;
+		if (p > words[0])
+			fd = atoi(words[0]);
 	}
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-		buf[--len] = 0; // trim right whitespace
+	if (*p != '<' && *p != '>')
+		return 0;
 
-	if (len > 0 && buf[len - 1] == '?') // auto-complete
-		command->auto_complete = true;
-	if (len > 0 && buf[len - 1] == '&') // background
-		command->background = true;
+	char op = *p;
+	if (strncmp(p, "<<<", 3) == 0) { type = REDIRECT_STRING; p += 3; }
+	else if (strncmp(p, ">>", 2) == 0) { type = REDIRECT_APPEND; p += 2; }
+	else if (!both && (strncmp(p, ">&", 2) == 0 || strncmp(p, "<&", 2) == 0)) { type = REDIRECT_DUP; p += 2; }
+	else if (*p == '>') { type = REDIRECT_OUTPUT; p++; }
+	else { type = REDIRECT_INPUT; p++; }
+	if (fd < 0)
+		fd = op == '<' ? 0 : 1;
 
-	char* pch = strtok(buf, splitters);
-	command->name = (char*)malloc(strlen(pch) + 1);
-	if (pch == NULL)
-		command->name[0] = 0;
-	else
-		strcpy(command->name, pch);
+	int used = 1;
+	char* target = p;
+	if (*target == '\0' && remaining > 1 && !operators[1])
+	{
+		target = words[1];
+		used = 2;
+	}
+
+	int extra = both ? 2 : 1;
+	command->redirects = realloc(command->redirects, sizeof(struct redirect_t) * (command->redirect_count + extra));
+	struct redirect_t* r = &command->redirects[command->redirect_count++];
+	r->type = type;
+	r->fd = fd;
+	r->target = strdup(target);
+	if (both)
+	{
+		r = &command->redirects[command->redirect_count++];
+		r->type = REDIRECT_DUP;
+		r->fd = 2;
+		r->target = strdup("1");
+	}
+	return used;
+}
+
+/**
+ * Build a command struct from already expanded words
+ * @param  words      command words, an operator "|" separates piped commands
+ * @param  operators  marks the words that were unquoted "|" or redirections
+ * @param  word_count number of words
+ * @param  command    [description]
+ * @return            0
+ */
+int parse_command(char** words, bool* operators, int word_count, struct command_t* command)
+{
+	int len = word_count > 0 ? strlen(words[word_count - 1]) : 0;
+	if (len > 0 && words[word_count - 1][len - 1] == '?') // auto-complete
+		command->auto_complete = true;
 
 	command->args = (char**)malloc(sizeof(char*));
 
-	int redirect_index;
 	int arg_index = 0;
-	char temp_buf[1024], * arg;
-	while (1)
+	char* arg;
+	for (int i = 0; i < word_count; i++)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch) break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
-
-		if (len == 0) continue; // empty arg, go for next
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-		{
-			arg++;
-			len--;
-		}
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) arg[--len] = 0; // trim right whitespace
-		if (len == 0) continue; // empty arg, go for next
+		arg = words[i];
 
 		// piping to another command
-		if (strcmp(arg, "|") == 0)
+		if (operators[i] && strcmp(arg, "|") == 0)
 		{
 			struct command_t* c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t') index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
+			memset(c, 0, sizeof(struct command_t));
+			parse_command(words + i + 1, operators + i + 1, word_count - i - 1, c);
 			command->next = c;
-			continue;
+			break;
 		}
 
-		// background process
-		if (strcmp(arg, "&") == 0)
-			continue; // handled before
-
-		// handle input redirection
-		redirect_index = -1;
-		if (arg[0] == '<')
-			redirect_index = 0;
-		if (arg[0] == '>')
+		// handle redirections, which may come before the command name
+		int used = operators[i] ? parse_redirect(words + i, operators + i, word_count - i, command) : 0;
+		if (used > 0)
 		{
-			if (len > 1 && arg[1] == '>')
-			{
-				redirect_index = 2;
-				arg++;
-				len--;
-			}
-			else redirect_index = 1;
+			i += used - 1;
+			continue;
 		}
-		if (redirect_index != -1)
+
+		// the first other word is the command name
+		if (command->name == NULL)
 		{
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
+			command->name = strdup(arg);
 			continue;
 		}
 
 		// normal arguments
-		if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"')
-			|| (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-		{
-			arg[--len] = 0;
-			arg++;
-		}
 		command->args = (char**)realloc(command->args, sizeof(char*) * (arg_index + 1));
-		command->args[arg_index] = (char*)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+		command->args[arg_index++] = strdup(arg);
 	}
+	if (command->name == NULL)
+		command->name = strdup("");
 	command->arg_count = arg_index;
 	return 0;
 }
 
-void prompt_backspace()
+/*
+ * Shell variables live in a chained hash table. Entries never move once
+ * created, so the parser binds each $name (and each for loop variable)
+ * to its entry once and execution never hashes a name again.
+ */
+#define VAR_BUCKETS 256
+
+struct var_t {
+	char* name;
+	char* value; // NULL while unset; then the environment is consulted
+	struct var_t* next;
+};
+
+struct var_t* var_table[VAR_BUCKETS];
+
+struct var_t* var_lookup(const char* name, size_t len)
 {
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
+	unsigned h = 5381;
+	for (size_t i = 0; i < len; i++)
+		h = h * 33 + (unsigned char)name[i];
+	struct var_t** bucket = &var_table[h % VAR_BUCKETS];
+	for (struct var_t* v = *bucket; v; v = v->next)
+		if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0')
+			return v;
+	struct var_t* v = calloc(1, sizeof(struct var_t));
+	v->name = strndup(name, len);
+	v->next = *bucket;
+	*bucket = v;
+	return v;
 }
 
-/**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+void var_set(struct var_t* var, const char* value)
+{
+	free(var->value);
+	var->value = strdup(value);
+}
+
+const char* var_get(struct var_t* var)
+{
+	if (var->value)
+		return var->value;
+	const char* env = getenv(var->name);
+	return env ? env : "";
+}
+
+bool is_name_char(char c, bool first)
+{
+	return c == '_' || isalpha((unsigned char)c) || (!first && isdigit((unsigned char)c));
+}
+
+/*
+ * A word split at parse time into literal text and expansions.
  */
-int prompt(struct command_t* command)
+enum segment_kind {
+	SEG_TEXT,
+	SEG_VAR, // $name, ${name}
+	SEG_ARG, // $1 .. $9
+	SEG_ARGS, // $@
+	SEG_ARGC, // $#
+	SEG_STATUS, // $?
+};
+
+struct segment_t {
+	enum segment_kind kind;
+	bool quoted; // inside "...": no field splitting
+	char* text;
+	struct var_t* var;
+	int index;
+};
+
+struct word_t {
+	char* op; // unquoted "|" or redirection operator, which has no text
+	char* text; // the whole word when it has no expansions
+	struct segment_t* parts;
+	int part_count;
+};
+
+struct strvec_t {
+	char** items;
+	int count;
+	int cap;
+};
+
+void strvec_push(struct strvec_t* v, char* s)
 {
-	int index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
+	if (v->count + 1 >= v->cap)
+	{
+		v->cap = v->cap ? v->cap * 2 : 8;
+		v->items = realloc(v->items, sizeof(char*) * v->cap);
+	}
+	v->items[v->count++] = s;
+	v->items[v->count] = NULL;
+}
 
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+void strvec_free(struct strvec_t* v)
+{
+	for (int i = 0; i < v->count; i++)
+		free(v->items[i]);
+	free(v->items);
+	memset(v, 0, sizeof(*v));
+}
 
+enum token_type {
+	TOKEN_WORD,
+	TOKEN_NEWLINE,
+	TOKEN_SEMI,
+	TOKEN_AMP,
+	TOKEN_AND,
+	TOKEN_OR,
+	TOKEN_PIPE,
+	TOKEN_LPAREN,
+	TOKEN_RPAREN,
+	TOKEN_END,
+};
 
-	//FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state = 0;
-	buf[0] = 0;
-	while (1)
+struct token_t {
+	enum token_type type;
+	char* text; // raw word, quotes still in place
+};
+
+enum parse_result {
+	PARSE_OK = 0,
+	PARSE_INCOMPLETE = 1, // needs another line (open quote, missing fi/done/...)
+	PARSE_ERROR = 2,
+};
+
+/*
+ * Turns a here-document into the equivalent here-string word, so the
+ * body travels with the command like any other word. An unquoted
+ * delimiter keeps $expansion in the body, a quoted one does not.
+ */
+char* heredoc_word(const char* op_word, const char* body, size_t len)
+{
+	const char* delim = strstr(op_word, "<<") + 2;
+	bool literal = strpbrk(delim, "'\"\\") != NULL;
+	char* word = malloc((delim - op_word) + 1 + 4 * len + 3);
+	char* w = word;
+	memcpy(w, op_word, delim - op_word);
+	w += delim - op_word;
+	*w++ = '<'; // <<DELIM becomes <<<"body"
+	*w++ = literal ? '\'' : '"';
+	if (len > 0 && body[len - 1] == '\n') // <<< adds the final newline back
+		len--;
+	for (size_t i = 0; i < len; i++)
 	{
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+		if (literal && body[i] == '\'')
+		{
+			memcpy(w, "'\\''", 4);
+			w += 4;
+			continue;
+		}
+		if (!literal && (body[i] == '"' || body[i] == '\\'))
+			*w++ = '\\';
+		*w++ = body[i];
+	}
+	*w++ = literal ? '\'' : '"';
+	*w = '\0';
+	return word;
+}
 
-		if (c == 9) // handle tab
+/*
+ * Reads the here-document body that starts at *s up to the line holding
+ * only the delimiter. Returns NULL if the input ends first.
+ */
+char* read_heredoc(const char** s, const char* op_word)
+{
+	const char* raw = strstr(op_word, "<<") + 2;
+	char* delim = malloc(strlen(raw) + 1);
+	size_t n = 0;
+	for (; *raw; raw++)
+		if (*raw != '\'' && *raw != '"' && *raw != '\\')
+			delim[n++] = *raw;
+	delim[n] = '\0';
+
+	const char* body = *s;
+	const char* line = *s;
+	while (*line)
+	{
+		const char* end = strchr(line, '\n');
+		size_t len = end ? (size_t)(end - line) : strlen(line);
+		if (len == n && strncmp(line, delim, n) == 0)
 		{
-			buf[index++] = '?'; // autocomplete
-			break;
+			char* word = heredoc_word(op_word, body, line - body);
+			*s = end ? end + 1 : line + len;
+			free(delim);
+			return word;
 		}
+		if (!end)
+			break;
+		line = end + 1;
+	}
+	free(delim);
+	return NULL;
+}
 
-		if (c == 127) // handle backspace
+bool is_heredoc(const char* word)
+{
+	while (isdigit((unsigned char)*word)) word++;
+	return strncmp(word, "<<", 2) == 0 && word[2] != '<';
+}
+
+/*
+ * Splits a line into words and operators. Quotes and backslashes only
+ * decide where words end here; they are removed by compile_word.
+ * Here-document bodies are consumed after the line that opens them.
+ */
+int tokenize(const char* s, struct token_t** tokens, int* count)
+{
+	int cap = 16;
+	int heredocs[16], heredoc_count = 0;
+	int delimiter_for = -1; // "<<" waiting for a detached delimiter word
+	*tokens = malloc(sizeof(struct token_t) * cap);
+	*count = 0;
+	while (1)
+	{
+		if (*count + 1 >= cap)
+			*tokens = realloc(*tokens, sizeof(struct token_t) * (cap *= 2));
+		struct token_t* t = &(*tokens)[(*count)++];
+		t->text = NULL;
+
+		while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+		if (*s == '#')
+			while (*s && *s != '\n') s++;
+
+		if (*s == '\0' && heredoc_count > 0)
+			return PARSE_INCOMPLETE;
+		if (*s == '\n' && heredoc_count > 0)
 		{
-			if (index > 0)
+			s++;
+			for (int i = 0; i < heredoc_count; i++)
 			{
-				prompt_backspace();
-				index--;
+				struct token_t* h = &(*tokens)[heredocs[i]];
+				char* word = read_heredoc(&s, h->text);
+				if (word == NULL)
+					return PARSE_INCOMPLETE;
+				free(h->text);
+				h->text = word;
 			}
+			heredoc_count = 0;
+			t->type = TOKEN_NEWLINE;
 			continue;
 		}
-		if (c == 27 && multicode_state == 0) // handle multi-code keys
+
+		if (*s == '\0') { t->type = TOKEN_END; return PARSE_OK; }
+		if (*s == '\n') { t->type = TOKEN_NEWLINE; s++; continue; }
+		if (*s == ';') { t->type = TOKEN_SEMI; s++; continue; }
+		if (*s == '(') { t->type = TOKEN_LPAREN; s++; continue; }
+		if (*s == ')') { t->type = TOKEN_RPAREN; s++; continue; }
+		if (*s == '&' && s[1] != '>') { t->type = s[1] == '&' ? TOKEN_AND : TOKEN_AMP; s += s[1] == '&' ? 2 : 1; continue; }
+		if (*s == '|') { t->type = s[1] == '|' ? TOKEN_OR : TOKEN_PIPE; s += s[1] == '|' ? 2 : 1; continue; }
+
+		const char* start = s;
+		char quote = 0;
+		// '&' belongs to the word in &>, >& and <&
+		while (*s && (quote || !strchr(" \t\r\n;&|()", *s)
+			|| (*s == '&' && (s == start ? s[1] == '>' : (s[-1] == '>' || s[-1] == '<')))))
 		{
-			multicode_state = 1;
-			continue;
+			if (quote && *s == quote)
+				quote = 0;
+			else if (!quote && (*s == '\'' || *s == '"'))
+				quote = *s;
+			else if (*s == '\\' && quote != '\'' && s[1])
+				s++;
+			s++;
 		}
-		if (c == 91 && multicode_state == 1)
+		if (quote)
 		{
-			multicode_state = 2;
+			(*count)--;
+			return PARSE_INCOMPLETE;
+		}
+		t->type = TOKEN_WORD;
+		t->text = strndup(start, s - start);
+
+		if (delimiter_for >= 0)
+		{
+			// "<< EOF": fold the delimiter into the operator word
+			struct token_t* h = &(*tokens)[delimiter_for];
+			h->text = realloc(h->text, strlen(h->text) + strlen(t->text) + 1);
+			strcat(h->text, t->text);
+			free(t->text);
+			(*count)--;
+			delimiter_for = -1;
+		}
+		else if (is_heredoc(t->text) && heredoc_count < 16)
+		{
+			heredocs[heredoc_count++] = *count - 1;
+			if (strstr(t->text, "<<")[2] == '\0')
+				delimiter_for = *count - 1;
+		}
+	}
+}
+
+void free_tokens(struct token_t* tokens, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(tokens[i].text);
+	free(tokens);
+}
+
+void word_add_part(struct word_t* w, enum segment_kind kind, bool quoted, char* text, struct var_t* var, int index)
+{
+	w->parts = realloc(w->parts, sizeof(struct segment_t) * (w->part_count + 1));
+	struct segment_t* seg = &w->parts[w->part_count++];
+	seg->kind = kind;
+	seg->quoted = quoted;
+	seg->text = text;
+	seg->var = var;
+	seg->index = index;
+}
+
+/*
+ * Removes quotes and escapes and binds $expansions, once per parse.
+ */
+void compile_word(const char* raw, struct word_t* w)
+{
+	size_t len = strlen(raw);
+	char* lit = malloc(len + 1);
+	size_t n = 0;
+	char quote = 0;
+	bool expands = false;
+	memset(w, 0, sizeof(*w));
+
+	for (const char* p = raw; *p; p++)
+	{
+		if (quote && *p == quote) { quote = 0; continue; }
+		if (!quote && (*p == '\'' || *p == '"')) { quote = *p; continue; }
+		if (*p == '\\' && quote != '\'' && p[1])
+		{
+			lit[n++] = *++p;
 			continue;
 		}
-		if (c == 65 && multicode_state == 2) // up arrow
+		if (*p != '$' || quote == '\'' || !p[1])
 		{
-			int i;
-			while (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			for (i = 0;oldbuf[i];++i)
-			{
-				putchar(oldbuf[i]);
-				buf[i] = oldbuf[i];
-			}
-			index = i;
+			lit[n++] = *p;
 			continue;
 		}
+
+		const char* name = p + 1;
+		enum segment_kind kind = SEG_VAR;
+		size_t name_len = 0;
+		const char* end;
+		if (*name == '{' && strchr(name, '}'))
+		{
+			name++;
+			end = strchr(name, '}');
+			name_len = end - name;
+		}
+		else if (*name == '@' || *name == '#' || *name == '?' || isdigit((unsigned char)*name))
+		{
+			name_len = 1;
+			end = name;
+		}
 		else
-			multicode_state = 0;
+		{
+			while (is_name_char(name[name_len], name_len == 0)) name_len++;
+			end = name + name_len - 1;
+		}
+		if (name_len == 0)
+		{
+			lit[n++] = *p;
+			continue;
+		}
+		if (name_len == 1 && *name == '@') kind = SEG_ARGS;
+		else if (name_len == 1 && *name == '#') kind = SEG_ARGC;
+		else if (name_len == 1 && *name == '?') kind = SEG_STATUS;
+		else if (name_len == 1 && isdigit((unsigned char)*name)) kind = SEG_ARG;
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1) break;
-		if (c == '\n') // enter key
-			break;
-		if (c == 4) // Ctrl+D
-			return EXIT;
+		if (n > 0)
+			word_add_part(w, SEG_TEXT, quote != 0, strndup(lit, n), NULL, 0);
+		n = 0;
+		word_add_part(w, kind, quote != 0, NULL,
+			kind == SEG_VAR ? var_lookup(name, name_len) : NULL, *name - '0');
+		expands = true;
+		p = end;
 	}
-	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-		index--;
-	buf[index++] = 0; // null terminate string
+	lit[n] = '\0';
+	if (expands && n > 0)
+		word_add_part(w, SEG_TEXT, true, strndup(lit, n), NULL, 0);
+	if (!expands)
+		w->text = lit;
+	else
+		free(lit);
+}
 
-	strcpy(oldbuf, buf);
+/*
+ * Length of the redirection operator an unquoted word starts with:
+ * [n]<, [n]>, [n]>>, [n]>&, [n]<&, [n]<<<, &> or &>>. 0 if none.
+ */
+int redirect_length(const char* raw)
+{
+	const char* p = raw;
+	bool both = p[0] == '&' && p[1] == '>';
+	if (both)
+		p++;
+	else
+		while (isdigit((unsigned char)*p)) p++;
+	if (*p != '<' && *p != '>')
+		return 0;
+	if (strncmp(p, "<<<", 3) == 0)
+		p += 3;
+	else if (strncmp(p, ">>", 2) == 0)
+		p += 2;
+	else if (!both && (strncmp(p, ">&", 2) == 0 || strncmp(p, "<&", 2) == 0))
+		p += 2;
+	else
+		p++;
+	return p - raw;
+}
 
-	parse_command(buf, command);
+void free_word(struct word_t* w)
+{
+	free(w->op);
+	free(w->text);
+	for (int i = 0; i < w->part_count; i++)
+		free(w->parts[i].text);
+	free(w->parts);
+}
 
-	// print_command(command); // DEBUG: uncomment for debugging
+enum node_type {
+	NODE_COMMAND, // simple command, possibly piped
+	NODE_LIST, // left ; right
+	NODE_AND, // left && right
+	NODE_OR, // left || right
+	NODE_IF, // if left then right else other
+	NODE_WHILE, // while/until left do right done
+	NODE_FOR, // for var in words do right done
+	NODE_FUNCTION, // name() right
+};
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
-}
+/*
+ * Parsed-once syntax tree. Loop bodies and function bodies are executed
+ * straight from the tree on every iteration or call.
+ */
+struct node_t {
+	enum node_type type;
+	int refs; // functions and !! keep subtrees alive
+	struct node_t* left;
+	struct node_t* right;
+	struct node_t* other;
+	struct word_t* words;
+	int word_count;
+	struct var_t* var;
+	char* name;
+	bool background;
+	bool until;
+};
 
-int process_command(struct command_t* command);
+struct parser_t {
+	struct token_t* tokens;
+	int pos;
+	int result;
+};
 
-struct command_t* old_command;
+struct node_t* new_node(enum node_type type)
+{
+	struct node_t* node = calloc(1, sizeof(struct node_t));
+	node->type = type;
+	node->refs = 1;
+	return node;
+}
 
-FILE* fp;
-FILE* fp2;
-char name[100];
-char name2[100];
-char* tf = "/shortdir_memory.txt";
-char* tf2 = "/tmp.txt";
-char cwd[100];
+void free_node(struct node_t* node)
+{
+	if (node == NULL || --node->refs > 0)
+		return;
+	free_node(node->left);
+	free_node(node->right);
+	free_node(node->other);
+	for (int i = 0; i < node->word_count; i++)
+		free_word(&node->words[i]);
+	free(node->words);
+	free(node->name);
+	free(node);
+}
 
-int main()
+void node_add_word(struct node_t* node, const char* raw)
 {
-	getcwd(name, sizeof(name));
-	strcat(name, tf);
+	node->words = realloc(node->words, sizeof(struct word_t) * (node->word_count + 1));
+	compile_word(raw, &node->words[node->word_count++]);
+}
 
-	getcwd(name2, sizeof(name2));
-	strcat(name2, tf2);
-	while (1)
-	{
-		struct command_t* command = malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+/*
+ * Operators are kept apart from ordinary words, so quoting or expanding
+ * to "|" or ">f" never turns into a pipe or a redirection
+ */
+void node_add_operator(struct node_t* node, const char* op, size_t len)
+{
+	node->words = realloc(node->words, sizeof(struct word_t) * (node->word_count + 1));
+	struct word_t* w = &node->words[node->word_count++];
+	memset(w, 0, sizeof(*w));
+	w->op = strndup(op, len);
+}
 
-		int code;
-		code = prompt(command);
-		if (code == EXIT) break;
+struct token_t* peek(struct parser_t* p)
+{
+	return &p->tokens[p->pos];
+}
 
-		code = process_command(command);
-		if (code == EXIT) break;
+bool at_keyword(struct parser_t* p, const char* keyword)
+{
+	struct token_t* t = peek(p);
+	return t->type == TOKEN_WORD && strcmp(t->text, keyword) == 0;
+}
 
-		if (strcmp(command->name, "!!") != 0) {
-			if (old_command != NULL) {
-				free_command(old_command);
-			}
-			old_command = command;
-		}
+void syntax_error(struct parser_t* p)
+{
+	struct token_t* t = peek(p);
+	if (p->result != PARSE_OK)
+		return;
+	if (t->type == TOKEN_END)
+	{
+		p->result = PARSE_INCOMPLETE;
+		return;
 	}
+	const char* names[] = { "", "newline", ";", "&", "&&", "||", "|", "(", ")", "" };
+	printf("-%s: syntax error near unexpected token `%s'\n", sysname,
+		t->type == TOKEN_WORD ? t->text : names[t->type]);
+	p->result = PARSE_ERROR;
+}
 
-	printf("\n");
-	return 0;
+bool expect_keyword(struct parser_t* p, const char* keyword)
+{
+	if (!at_keyword(p, keyword))
+	{
+		syntax_error(p);
+		return false;
+	}
+	p->pos++;
+	return true;
 }
 
-char* toLower(char* s) {
-	for (char* p = s; *p; p++) *p = tolower(*p);
-	return s;
+void skip_newlines(struct parser_t* p)
+{
+	while (peek(p)->type == TOKEN_NEWLINE) p->pos++;
 }
 
-int highlight(int argc, char* argv[]) {
-	if (argc > 2) {
-		fp = fopen(argv[2], "r");
-		if (fp == NULL) {
-			return SUCCESS;
-		}
+bool at_list_end(struct parser_t* p)
+{
+	const char* stops[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+	struct token_t* t = peek(p);
+	if (t->type == TOKEN_END || t->type == TOKEN_RPAREN)
+		return true;
+	for (int i = 0; i < (int)(sizeof(stops) / sizeof(stops[0])); i++)
+		if (at_keyword(p, stops[i]))
+			return true;
+	return false;
+}
 
-		toLower(argv[0]);
-
-		char line[100];
-		char word[50];
-		while (fgets(line, 100, fp)) {
-			char l2[100];
-			memset(l2, '\0', sizeof(l2));
-			strcpy(l2, strtok(line, "\r"));
-
-			char* token = strtok(l2, " ");
-			while (token != NULL) {
-				memset(word, '\0', sizeof(word));
-				strcpy(word, token);
-				toLower(word);
-				if ((strcmp(word, argv[0]) == 0)) {
-					if (strcmp("r", argv[1]) == 0) {
-						printf("\033[0;31m");
-						printf("%s ", token);
-						printf("\033[0m");
-					}
-					else if (strcmp("g", argv[1]) == 0) {
-						printf("\033[0;32m");
-						printf("%s ", token);
-						printf("\033[0m");
-					}
-					else if (strcmp("b", argv[1]) == 0) {
-						printf("\033[0;34m");
-						printf("%s ", token);
-						printf("\033[0m");
-					}
+struct node_t* parse_list(struct parser_t* p);
+struct node_t* parse_compound(struct parser_t* p);
+
+struct node_t* parse_simple(struct parser_t* p)
+{
+	struct node_t* node = new_node(NODE_COMMAND);
+	while (1)
+	{
+		struct token_t* t = peek(p);
+		if (t->type == TOKEN_WORD)
+		{
+			// "2>file" is the operator "2>" and the word "file"
+			int op_len = redirect_length(t->text);
+			if (op_len > 0)
+				node_add_operator(node, t->text, op_len);
+			if (t->text[op_len] != '\0')
+				node_add_word(node, t->text + op_len);
+		}
+		else if (t->type == TOKEN_PIPE && node->word_count > 0)
+		{
+			node_add_operator(node, "|", 1);
+			p->pos++;
+			skip_newlines(p);
+			t = peek(p);
+			if (t->type != TOKEN_WORD)
+			{
+				syntax_error(p);
+				break;
+			}
+			continue;
+		}
+		else
+			break;
+		p->pos++;
+	}
+	if (node->word_count == 0)
+		syntax_error(p);
+	return node;
+}
+
+/*
+ * After "if" or "elif": condition, then-part and the optional elif/else
+ * chain. The closing fi is consumed by the outermost if.
+ */
+struct node_t* parse_if_rest(struct parser_t* p)
+{
+	struct node_t* node = new_node(NODE_IF);
+	node->left = parse_list(p);
+	if (!expect_keyword(p, "then"))
+		return node;
+	node->right = parse_list(p);
+	if (at_keyword(p, "elif"))
+	{
+		p->pos++;
+		node->other = parse_if_rest(p);
+	}
+	else if (at_keyword(p, "else"))
+	{
+		p->pos++;
+		node->other = parse_list(p);
+	}
+	return node;
+}
+
+struct node_t* parse_compound(struct parser_t* p)
+{
+	struct node_t* node;
+	if (p->result != PARSE_OK)
+		return NULL;
+
+	if (at_keyword(p, "if"))
+	{
+		p->pos++;
+		node = parse_if_rest(p);
+		expect_keyword(p, "fi");
+		return node;
+	}
+	if (at_keyword(p, "while") || at_keyword(p, "until"))
+	{
+		node = new_node(NODE_WHILE);
+		node->until = at_keyword(p, "until");
+		p->pos++;
+		node->left = parse_list(p);
+		if (expect_keyword(p, "do"))
+		{
+			node->right = parse_list(p);
+			expect_keyword(p, "done");
+		}
+		return node;
+	}
+	if (at_keyword(p, "for"))
+	{
+		node = new_node(NODE_FOR);
+		p->pos++;
+		struct token_t* t = peek(p);
+		if (t->type != TOKEN_WORD || !is_name_char(t->text[0], true))
+		{
+			syntax_error(p);
+			return node;
+		}
+		node->var = var_lookup(t->text, strlen(t->text));
+		p->pos++;
+		skip_newlines(p);
+		if (at_keyword(p, "in"))
+		{
+			p->pos++;
+			for (; peek(p)->type == TOKEN_WORD; p->pos++)
+				node_add_word(node, peek(p)->text);
+		}
+		else
+			node_add_word(node, "\"$@\"");
+		if (peek(p)->type == TOKEN_SEMI)
+			p->pos++;
+		skip_newlines(p);
+		if (expect_keyword(p, "do"))
+		{
+			node->right = parse_list(p);
+			expect_keyword(p, "done");
+		}
+		return node;
+	}
+	if (at_keyword(p, "{"))
+	{
+		p->pos++;
+		node = parse_list(p);
+		expect_keyword(p, "}");
+		return node ? node : new_node(NODE_LIST);
+	}
+	if (at_keyword(p, "function")
+		|| (peek(p)->type == TOKEN_WORD && p->tokens[p->pos + 1].type == TOKEN_LPAREN))
+	{
+		if (at_keyword(p, "function"))
+			p->pos++;
+		node = new_node(NODE_FUNCTION);
+		if (peek(p)->type != TOKEN_WORD)
+		{
+			syntax_error(p);
+			return node;
+		}
+		node->name = strdup(peek(p)->text);
+		p->pos++;
+		if (peek(p)->type == TOKEN_LPAREN)
+		{
+			p->pos++;
+			if (peek(p)->type != TOKEN_RPAREN)
+			{
+				syntax_error(p);
+				return node;
+			}
+			p->pos++;
+		}
+		skip_newlines(p);
+		node->right = parse_compound(p);
+		return node;
+	}
+	return parse_simple(p);
+}
+
+struct node_t* parse_and_or(struct parser_t* p)
+{
+	struct node_t* node = parse_compound(p);
+	while (p->result == PARSE_OK && (peek(p)->type == TOKEN_AND || peek(p)->type == TOKEN_OR))
+	{
+		struct node_t* parent = new_node(peek(p)->type == TOKEN_AND ? NODE_AND : NODE_OR);
+		p->pos++;
+		skip_newlines(p);
+		parent->left = node;
+		parent->right = parse_compound(p);
+		node = parent;
+	}
+	return node;
+}
+
+struct node_t* parse_list(struct parser_t* p)
+{
+	struct node_t* list = NULL;
+	while (p->result == PARSE_OK)
+	{
+		while (peek(p)->type == TOKEN_NEWLINE || peek(p)->type == TOKEN_SEMI)
+			p->pos++;
+		if (at_list_end(p))
+			break;
+
+		struct node_t* node = parse_and_or(p);
+		if (peek(p)->type == TOKEN_AMP)
+		{
+			if (node)
+				node->background = true;
+			p->pos++;
+		}
+		else if (p->result == PARSE_OK && peek(p)->type != TOKEN_SEMI
+			&& peek(p)->type != TOKEN_NEWLINE && !at_list_end(p))
+			syntax_error(p);
+
+		if (list == NULL)
+			list = node;
+		else
+		{
+			struct node_t* seq = new_node(NODE_LIST);
+			seq->left = list;
+			seq->right = node;
+			list = seq;
+		}
+	}
+	return list;
+}
+
+/*
+ * Parses a complete input (possibly several lines) into *tree.
+ * Returns PARSE_INCOMPLETE when more lines are needed.
+ */
+int parse_input(const char* text, struct node_t** tree)
+{
+	struct parser_t p = { NULL, 0, PARSE_OK };
+	int count;
+	*tree = NULL;
+	if (tokenize(text, &p.tokens, &count) != PARSE_OK)
+	{
+		free_tokens(p.tokens, count);
+		return PARSE_INCOMPLETE;
+	}
+	*tree = parse_list(&p);
+	if (p.result == PARSE_OK && peek(&p)->type != TOKEN_END)
+		syntax_error(&p);
+	free_tokens(p.tokens, count);
+	if (p.result != PARSE_OK)
+	{
+		free_node(*tree);
+		*tree = NULL;
+	}
+	return p.result;
+}
+
+/*
+ * The shell's event loop. SIGCHLD, SIGINT and SIGWINCH are blocked and
+ * read from a signalfd, so signals, terminal input and any other
+ * registered descriptor (a timerfd, a pipe) are all waited for in one
+ * epoll_wait.
+ */
+#define SIGNAL_BIT(sig) (1u << (sig))
+
+struct loop_source_t {
+	int fd;
+	void (*ready)(struct loop_source_t* source);
+};
+
+struct loop_t {
+	bool active; // false in forked children, which run without job control
+	bool job_control; // we own the terminal and hand it to foreground jobs
+	int epoll;
+	int signal; // signalfd, registered with a NULL source
+	sigset_t blocked;
+	sigset_t orig; // mask to restore in children
+	void (*old_ttou)(int);
+	int columns; // terminal width, kept current on SIGWINCH
+	int lines;
+	bool interrupted; // Ctrl+C hit the command line being executed
+} loop = { .columns = 80, .lines = 24 };
+
+struct job_t {
+	int id;
+	pid_t pgid;
+	pid_t pid; // its status is the job's status
+	char* text;
+	bool done;
+	bool notify; // a member stopped (e.g. on SIGTTIN), still to be announced
+	int status;
+	struct job_t* next;
+};
+
+struct job_t* jobs;
+
+int exit_status(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 128 + (WIFSTOPPED(status) ? WSTOPSIG(status) : WTERMSIG(status));
+}
+
+/*
+ * The command as the user would have typed it, for job notices
+ */
+char* command_text(struct command_t* command)
+{
+	size_t len = 1;
+	for (struct command_t* c = command; c; c = c->next)
+	{
+		len += strlen(c->name) + 3;
+		for (int i = 0; i < c->arg_count; i++)
+			len += strlen(c->args[i]) + 1;
+	}
+	char* text = malloc(len);
+	text[0] = '\0';
+	for (struct command_t* c = command; c; c = c->next)
+	{
+		strcat(text, c->name);
+		for (int i = 0; i < c->arg_count; i++)
+		{
+			strcat(text, " ");
+			strcat(text, c->args[i]);
+		}
+		if (c->next)
+			strcat(text, " | ");
+	}
+	return text;
+}
+
+/*
+ * Registers a background job. A foreground job stopped with Ctrl+Z
+ * (resumed) has just been sent SIGCONT and goes on in the background.
+ */
+void jobs_add(pid_t pgid, pid_t pid, char* text, bool resumed)
+{
+	struct job_t* job = calloc(1, sizeof(struct job_t));
+	struct job_t** tail = &jobs;
+	job->id = 1;
+	for (; *tail; tail = &(*tail)->next)
+		if ((*tail)->id >= job->id)
+			job->id = (*tail)->id + 1;
+	job->pgid = pgid;
+	job->pid = pid;
+	job->text = text;
+	*tail = job;
+	if (resumed)
+		printf("\n[%d] Running in background\t%s\n", job->id, job->text);
+	else
+		printf("[%d] %d\n", job->id, pid);
+}
+
+/*
+ * Collects every exited member of the background jobs and notes the
+ * ones that stop or continue. A job is done once no process is left in
+ * its group.
+ */
+void jobs_reap()
+{
+	for (struct job_t* job = jobs; job; job = job->next)
+	{
+		int status;
+		pid_t pid;
+		while (!job->done && (pid = waitpid(-job->pgid, &status, WNOHANG | WUNTRACED | WCONTINUED)) != 0)
+		{
+			if (pid == -1)
+				job->done = true;
+			else if (WIFSTOPPED(status))
+				job->notify = true;
+			else if (WIFCONTINUED(status))
+				job->notify = false;
+			else if (pid == job->pid)
+				job->status = status;
+		}
+	}
+}
+
+bool jobs_finished()
+{
+	for (struct job_t* job = jobs; job; job = job->next)
+		if (job->done || job->notify)
+			return true;
+	return false;
+}
+
+/*
+ * Prints the jobs that stopped, and prints and forgets the finished ones
+ */
+void jobs_announce()
+{
+	struct job_t** p = &jobs;
+	while (*p)
+	{
+		struct job_t* job = *p;
+		if (job->notify && !job->done)
+			printf("[%d] Stopped\t%s\n", job->id, job->text);
+		job->notify = false;
+		if (!job->done)
+		{
+			p = &job->next;
+			continue;
+		}
+		if (exit_status(job->status) == 0)
+			printf("[%d] Done\t%s\n", job->id, job->text);
+		else
+			printf("[%d] Exit %d\t%s\n", job->id, exit_status(job->status), job->text);
+		*p = job->next;
+		free(job->text);
+		free(job);
+	}
+	fflush(stdout);
+}
+
+void loop_resize()
+{
+	struct winsize ws;
+	char value[16];
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+		return;
+	loop.columns = ws.ws_col;
+	loop.lines = ws.ws_row;
+	snprintf(value, sizeof(value), "%d", loop.columns);
+	var_set(var_lookup("COLUMNS", 7), value);
+	snprintf(value, sizeof(value), "%d", loop.lines);
+	var_set(var_lookup("LINES", 5), value);
+}
+
+void loop_init()
+{
+	sigemptyset(&loop.blocked);
+	sigaddset(&loop.blocked, SIGCHLD);
+	sigaddset(&loop.blocked, SIGINT);
+	sigaddset(&loop.blocked, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &loop.blocked, &loop.orig);
+	// kept above the descriptors scripts name in redirections
+	int fd = signalfd(-1, &loop.blocked, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop.signal = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	close(fd);
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	loop.epoll = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	close(fd);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.signal, &ev);
+	loop.active = true;
+
+	// a shell in the background of its own terminal must not be stopped
+	// when it takes the terminal back from a job
+	loop.old_ttou = signal(SIGTTOU, SIG_IGN);
+	loop.job_control = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+	loop_resize();
+}
+
+/*
+ * Drops the shell's signal handling in a forked child
+ */
+void loop_leave()
+{
+	if (!loop.active)
+		return;
+	loop.active = false;
+	loop.job_control = false;
+	close(loop.epoll);
+	close(loop.signal);
+	signal(SIGTTOU, loop.old_ttou);
+	sigprocmask(SIG_SETMASK, &loop.orig, NULL);
+}
+
+int loop_add(struct loop_source_t* source)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = source };
+	return epoll_ctl(loop.epoll, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+void loop_remove(struct loop_source_t* source)
+{
+	epoll_ctl(loop.epoll, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/*
+ * Reads the pending signals, reaping jobs on SIGCHLD and refreshing the
+ * terminal size on SIGWINCH. Returns them as SIGNAL_BIT()s.
+ */
+unsigned loop_signals()
+{
+	struct signalfd_siginfo info;
+	unsigned signals = 0;
+	while (read(loop.signal, &info, sizeof(info)) == sizeof(info))
+		signals |= SIGNAL_BIT(info.ssi_signo);
+	if (signals & SIGNAL_BIT(SIGCHLD))
+		jobs_reap();
+	if (signals & SIGNAL_BIT(SIGWINCH))
+		loop_resize();
+	return signals;
+}
+
+/*
+ * Whether Ctrl+C was pressed while the current command line runs: a
+ * foreground job died of SIGINT or a SIGINT waits on the signalfd.
+ * Long builtin loops poll this to stop early.
+ */
+bool loop_interrupted()
+{
+	if (loop.active && !loop.interrupted && (loop_signals() & SIGNAL_BIT(SIGINT)))
+	{
+		loop.interrupted = true;
+		fprintf(stderr, "\n"); // the prompt would follow the ^C; stdout may be redirected
+	}
+	return loop.interrupted;
+}
+
+/*
+ * One round of the loop: waits up to timeout ms (-1 forever) and runs
+ * the ready sources. Returns the signals that arrived.
+ */
+unsigned loop_once(int timeout)
+{
+	struct epoll_event events[8];
+	unsigned signals = 0;
+	int n = epoll_wait(loop.epoll, events, 8, timeout);
+	for (int i = 0; i < n; i++)
+	{
+		struct loop_source_t* source = events[i].data.ptr;
+		if (source == NULL)
+			signals |= loop_signals();
+		else
+			source->ready(source);
+	}
+	return signals;
+}
+
+/*
+ * In a freshly forked child: joins group pgid (0 starts a new one),
+ * takes the terminal if it runs in the foreground and drops the
+ * shell's signal handling.
+ */
+void child_setup(pid_t pgid, bool foreground)
+{
+	if (loop.active)
+	{
+		setpgid(0, pgid);
+		if (foreground && loop.job_control)
+			tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+	}
+	loop_leave();
+}
+
+/*
+ * The parent's half of child_setup; both sides do it so neither
+ * depends on who runs first.
+ */
+void job_start(pid_t pid, pid_t pgid, bool foreground)
+{
+	if (!loop.active)
+		return;
+	setpgid(pid, pgid ? pgid : pid);
+	if (foreground && loop.job_control)
+		tcsetpgrp(STDIN_FILENO, pgid ? pgid : pid);
+}
+
+/*
+ * Waits for the processes of a foreground job while the loop keeps
+ * running: Ctrl+C is passed on to the job's group and background jobs
+ * are reaped as they finish. A job stopped with Ctrl+Z is continued in
+ * the background. Returns the wait status of the last process.
+ */
+int wait_job(pid_t pgid, pid_t* pids, int count, struct rusage* usage, struct command_t* command)
+{
+	int status = 0;
+	for (int i = 0; i < count; i++)
+	{
+		struct rusage* u = usage ? &usage[i] : NULL;
+		if (!loop.active)
+		{
+			wait4(pids[i], &status, 0, u);
+			continue;
+		}
+		while (wait4(pids[i], &status, WNOHANG | WUNTRACED, u) == 0)
+			if (loop_once(-1) & SIGNAL_BIT(SIGINT))
+				kill(-pgid, SIGINT);
+		if (WIFSTOPPED(status))
+		{
+			// there is no fg/bg: let it run rather than stay stopped
+			kill(-pgid, SIGCONT);
+			jobs_add(pgid, pids[count - 1], command_text(command), true);
+			break;
+		}
+	}
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+	{
+		fprintf(stderr, "\n"); // the prompt would follow the ^C
+		loop.interrupted = true; // and the rest of the command line is dropped
+	}
+	if (loop.job_control)
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	return status;
+}
+
+/*
+ * Terminal input, read through the loop so the prompt keeps serving
+ * signals and jobs while the user types
+ */
+#define PROMPT_INTERRUPT -2 // Ctrl+C
+#define PROMPT_REDRAW -3 // job notices were printed over the line
+
+struct input_t {
+	char data[4096];
+	int len;
+	int pos;
+	bool eof;
+} input;
+
+void terminal_ready(struct loop_source_t* source)
+{
+	ssize_t n = read(source->fd, input.data, sizeof(input.data));
+	if (n > 0)
+	{
+		input.len = n;
+		input.pos = 0;
+	}
+	else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+		input.eof = true;
+}
+
+struct loop_source_t terminal = { STDIN_FILENO, terminal_ready };
+
+int prompt_getchar(bool polled)
+{
+	while (input.pos == input.len && !input.eof)
+	{
+		// a regular file cannot be polled and is simply read
+		unsigned signals = loop_once(polled ? -1 : 0);
+		if (signals & SIGNAL_BIT(SIGINT))
+			return PROMPT_INTERRUPT;
+		if (jobs_finished())
+			return PROMPT_REDRAW;
+		if (!polled)
+			terminal_ready(&terminal);
+	}
+	if (input.pos == input.len)
+		return EOF;
+	return (unsigned char)input.data[input.pos++];
+}
+
+void prompt_backspace()
+{
+	putchar(8); // go back 1
+	putchar(' '); // write empty over
+	putchar(8); // go back 1 again
+}
+
+/**
+ * Prompt a line from the user
+ * @param  buf          receives the line, PROMPT_SIZE bytes
+ * @param  continuation show the "> " prompt of an unfinished command
+ * @return              SUCCESS, EXIT on Ctrl+D, INTERRUPTED on Ctrl+C
+ */
+int prompt(char* buf, bool continuation)
+{
+	int index = 0;
+	int c;
+	static char oldbuf[PROMPT_SIZE];
+
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	// a Ctrl+C for the command line that just ended is stale by now
+	loop_signals();
+	if (!continuation)
+		jobs_announce();
+	bool polled = loop_add(&terminal) == 0;
+
+	//FIXME: backspace is applied before printing chars
+	int width;
+	if (continuation)
+		width = printf("> ");
+	else
+		width = show_prompt();
+	fflush(stdout);
+	int multicode_state = 0;
+	buf[0] = 0;
+	while (1)
+	{
+		c = prompt_getchar(polled);
+		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+		if (c == PROMPT_REDRAW) // clear the line, print the notices, draw it again
+		{
+			int rows = (width + index) / loop.columns;
+			printf("\r");
+			if (rows > 0)
+				printf("\033[%dA", rows);
+			printf("\033[J");
+			jobs_announce();
+			width = continuation ? printf("> ") : show_prompt();
+			printf("%.*s", index, buf);
+			fflush(stdout);
+			continue;
+		}
+
+		if (c == PROMPT_INTERRUPT)
+		{
+			printf("^C\n");
+			if (polled)
+				loop_remove(&terminal);
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			buf[0] = 0;
+			return INTERRUPTED;
+		}
+
+		if (c == 9) // handle tab
+		{
+			buf[index++] = '?'; // autocomplete
+			break;
+		}
+
+		if (c == 127) // handle backspace
+		{
+			if (index > 0)
+			{
+				prompt_backspace();
+				index--;
+			}
+			fflush(stdout);
+			continue;
+		}
+		if (c == 27 && multicode_state == 0) // handle multi-code keys
+		{
+			multicode_state = 1;
+			continue;
+		}
+		if (c == 91 && multicode_state == 1)
+		{
+			multicode_state = 2;
+			continue;
+		}
+		if (c == 65 && multicode_state == 2) // up arrow
+		{
+			int i;
+			while (index > 0)
+			{
+				prompt_backspace();
+				index--;
+			}
+			for (i = 0;oldbuf[i];++i)
+			{
+				putchar(oldbuf[i]);
+				buf[i] = oldbuf[i];
+			}
+			index = i;
+			fflush(stdout);
+			continue;
+		}
+		else
+			multicode_state = 0;
+
+		if (c == EOF || c == 4) // Ctrl+D
+		{
+			if (polled)
+				loop_remove(&terminal);
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
+		putchar(c); // echo the character
+		fflush(stdout);
+		buf[index++] = c;
+		if (index >= PROMPT_SIZE - 1) break;
+		if (c == '\n') // enter key
+			break;
+	}
+	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+		index--;
+	buf[index++] = 0; // null terminate string
+
+	strcpy(oldbuf, buf);
+
+	// restore the old settings
+	if (polled)
+		loop_remove(&terminal);
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	return SUCCESS;
+}
+
+int process_command(struct command_t* command);
+int execute_node(struct node_t* node);
+
+char name[100];
+char name2[100];
+char* tf = "/shortdir_memory.txt";
+char* tf2 = "/tmp.txt";
+char name3[PATH_MAX]; // empty when there is no cache file to use
+char* tf3 = "/kdiff_cache.bin";
+char name4[PATH_MAX]; // empty when memo cannot keep a store
+char* tf4 = "/memo_cache";
+char cwd[100];
+
+int main()
+{
+	char start[PATH_MAX];
+	if (getcwd(start, sizeof(start)) == NULL)
+		start[0] = '\0';
+
+	getcwd(name, sizeof(name));
+	strcat(name, tf);
+
+	getcwd(name2, sizeof(name2));
+	strcat(name2, tf2);
+
+	if (start[0] == '\0' || snprintf(name3, sizeof(name3), "%s%s", start, tf3) >= (int)sizeof(name3))
+		name3[0] = '\0';
+
+	if (start[0] == '\0' || snprintf(name4, sizeof(name4), "%s%s", start, tf4) >= (int)sizeof(name4))
+		name4[0] = '\0';
+	loop_init();
+	char buf[PROMPT_SIZE];
+	struct node_t* old_tree = NULL;
+	while (1)
+	{
+		int code;
+		code = prompt(buf, false);
+		if (code == EXIT) break;
+		if (code == INTERRUPTED) continue;
+
+		// keep reading lines until if/for/while/... are closed
+		struct node_t* tree;
+		char* input = strdup(buf);
+		int result;
+		while ((result = parse_input(input, &tree)) == PARSE_INCOMPLETE)
+		{
+			code = prompt(buf, true);
+			if (code != SUCCESS) break;
+			input = realloc(input, strlen(input) + strlen(buf) + 2);
+			strcat(input, "\n");
+			strcat(input, buf);
+		}
+		free(input);
+		if (code == EXIT) break;
+		if (code == INTERRUPTED) continue;
+		if (result != PARSE_OK || tree == NULL) continue;
+
+		if (tree->type == NODE_COMMAND && tree->word_count == 1
+			&& tree->words[0].text && strcmp(tree->words[0].text, "!!") == 0)
+		{
+			free_node(tree);
+			if (old_tree == NULL) {
+				printf("No commands on history\n");
+				continue;
+			}
+			tree = old_tree;
+			tree->refs++;
+		}
+
+		loop.interrupted = false;
+		code = execute_node(tree);
+
+		free_node(old_tree);
+		old_tree = tree;
+		if (code == EXIT) break;
+	}
+
+	printf("\n");
+	return 0;
+}
+
+char* toLower(char* s) {
+	for (char* p = s; *p; p++) *p = tolower(*p);
+	return s;
+}
+
+#define READER_CHUNK_SIZE (1 << 20) // bytes per read request
+#define READER_DEPTH 4 // read requests kept in flight per file
+
+/*
+ * Minimal io_uring driven through the raw syscalls: one submission and
+ * one completion ring, used only for IORING_OP_READ.
+ */
+struct uring_t {
+	int fd;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned to_submit;
+};
+
+/*
+ * Sequential reader over one file. Up to READER_DEPTH chunks are read
+ * ahead (through io_uring when available, otherwise pread with readahead
+ * hints) while the caller works on the chunk handed out last.
+ */
+struct reader_t {
+	int fd;
+	off_t size; // size at open, only sizes the read-ahead
+	size_t chunk;
+	bool stream; // not a regular file: plain sequential read()
+	bool eof; // a read returned 0 bytes, nothing more is requested
+	struct uring_t* ring;
+	off_t submit_offset; // next file offset to request
+	int depth;
+	int head; // slot holding the next chunk in file order
+	int pending; // slots requested but not handed out yet
+	int refill; // slot handed out last, reused on the next call
+	unsigned char* bufs[READER_DEPTH];
+	off_t offsets[READER_DEPTH];
+	size_t lens[READER_DEPTH];
+	ssize_t results[READER_DEPTH];
+	bool in_flight[READER_DEPTH];
+	const unsigned char* cur; // chunk being split into lines
+	size_t cur_len;
+	size_t cur_pos;
+	char* line;
+	size_t line_cap;
+};
+
+int uring_setup(struct uring_t* ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto fail_sq;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+	return 0;
+
+fail_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+fail:
+	close(ring->fd);
+	return -1;
+}
+
+void uring_close(struct uring_t* ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+int uring_submit_read(struct uring_t* ring, int fd, void* buf, size_t len, off_t offset, uint64_t user_data) {
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	int r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0, NULL, 0);
+	if (r < 0 && errno != EINTR && errno != EAGAIN) {
+		// nothing was consumed: take the entry back, or a later enter
+		// would read into a buffer the caller now fills with pread
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		ring->to_submit--;
+		return -1;
+	}
+	if (r > 0)
+		ring->to_submit -= r;
+	return 0;
+}
+
+/*
+ * Blocks until a completion is available and pops it.
+ */
+int uring_wait(struct uring_t* ring, struct io_uring_cqe* cqe) {
+	while (1) {
+		unsigned head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			*cqe = ring->cqes[head & *ring->cq_mask];
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		int r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0 && errno != EINTR)
+			return -1;
+		if (r > 0)
+			ring->to_submit -= r;
+	}
+}
+
+void reader_request(struct reader_t* r, int slot) {
+	size_t len = r->chunk;
+	r->offsets[slot] = r->submit_offset;
+	r->lens[slot] = len;
+	r->results[slot] = 0;
+	r->submit_offset += len;
+	r->pending++;
+
+	if (r->ring)
+		r->in_flight[slot] = uring_submit_read(r->ring, r->fd, r->bufs[slot], len, r->offsets[slot], slot) == 0;
+	else if (!r->stream)
+		posix_fadvise(r->fd, r->offsets[slot], len, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Reads the rest of a slot synchronously, used by the pread fallback and
+ * to finish short io_uring reads.
+ */
+ssize_t reader_fill(struct reader_t* r, int slot, size_t got) {
+	while (got < (size_t)r->lens[slot]) {
+		ssize_t n = r->stream
+			? read(r->fd, r->bufs[slot] + got, r->lens[slot] - got)
+			: pread(r->fd, r->bufs[slot] + got, r->lens[slot] - got, r->offsets[slot] + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		got += n;
+		if (r->stream)
+			break;
+	}
+	return got;
+}
+
+int reader_open_fd(struct reader_t* r, int fd, size_t chunk) {
+	struct stat st;
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->chunk = chunk;
+	r->refill = -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	r->stream = !S_ISREG(st.st_mode);
+	r->size = st.st_size;
+
+	r->depth = r->stream ? 1 : (r->size + chunk - 1) / chunk;
+	if (r->depth > READER_DEPTH)
+		r->depth = READER_DEPTH;
+	if (r->depth == 0)
+		r->depth = 1;
+	// a page past the size, so the first read already finds the end of
+	// the file (procfs files report 0 and still have contents)
+	if (!r->stream && r->size < (off_t)chunk)
+		r->chunk = (r->size / 4096 + 1) * 4096;
+	for (int i = 0; i < r->depth; i++)
+		r->bufs[i] = malloc(r->chunk);
+
+	if (!r->stream) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (r->depth > 1) {
+			r->ring = malloc(sizeof(struct uring_t));
+			if (uring_setup(r->ring, READER_DEPTH) < 0) {
+				free(r->ring);
+				r->ring = NULL;
+			}
+		}
+	}
+	for (int i = 0; i < r->depth; i++)
+		reader_request(r, i);
+	return 0;
+}
+
+int reader_open(struct reader_t* r, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	return reader_open_fd(r, fd, READER_CHUNK_SIZE);
+}
+
+void reader_close(struct reader_t* r) {
+	struct io_uring_cqe cqe;
+	if (r->ring) {
+		// buffers may still be the target of in-flight reads
+		for (int i = 0; i < r->depth; i++)
+			while (r->in_flight[i] && uring_wait(r->ring, &cqe) == 0)
+				r->in_flight[cqe.user_data] = false;
+		uring_close(r->ring);
+		free(r->ring);
+	}
+	for (int i = 0; i < r->depth; i++)
+		free(r->bufs[i]);
+	free(r->line);
+	close(r->fd);
+}
+
+/*
+ * Hands out the next chunk in file order through *buf, valid until the
+ * next call. Returns its length, 0 at end of file or -1 on error.
+ */
+ssize_t reader_next(struct reader_t* r, const unsigned char** buf) {
+	struct io_uring_cqe cqe;
+	if (r->refill >= 0 && !r->eof)
+		reader_request(r, r->refill);
+	r->refill = -1;
+	if (r->pending == 0)
+		return 0;
+
+	int slot = r->head;
+	while (r->in_flight[slot]) {
+		if (uring_wait(r->ring, &cqe) < 0)
+			return -1;
+		r->in_flight[cqe.user_data] = false;
+		r->results[cqe.user_data] = cqe.res;
+	}
+	// failed or short requests (e.g. no IORING_OP_READ) finish synchronously
+	ssize_t got = reader_fill(r, slot, r->results[slot] > 0 ? r->results[slot] : 0);
+	if (got < 0)
+		return -1;
+
+	// a short chunk is the end of the file, whatever its size was at open;
+	// chunks requested after it are left unread
+	if (got == 0 || (!r->stream && (size_t)got < r->lens[slot]))
+		r->eof = true;
+	r->pending = r->eof ? 0 : r->pending - 1;
+	r->refill = slot;
+	r->head = (slot + 1) % r->depth;
+	*buf = r->bufs[slot];
+	return got;
+}
+
+/*
+ * Returns the next line including its '\n' (like fgets, but of any
+ * length) in a buffer owned by the reader, or NULL at end of file.
+ */
+char* reader_getline(struct reader_t* r, size_t* len) {
+	size_t n = 0;
+	while (1) {
+		if (r->cur_pos == r->cur_len) {
+			ssize_t got = reader_next(r, &r->cur);
+			if (got <= 0)
+				break;
+			r->cur_len = got;
+			r->cur_pos = 0;
+		}
+		const unsigned char* start = r->cur + r->cur_pos;
+		const unsigned char* nl = memchr(start, '\n', r->cur_len - r->cur_pos);
+		size_t take = nl ? (size_t)(nl - start) + 1 : r->cur_len - r->cur_pos;
+		if (n + take + 1 > r->line_cap) {
+			r->line_cap = (n + take + 1) * 2;
+			r->line = realloc(r->line, r->line_cap);
+		}
+		memcpy(r->line + n, start, take);
+		n += take;
+		r->cur_pos += take;
+		if (nl)
+			break;
+	}
+	if (n == 0)
+		return NULL;
+	r->line[n] = 0;
+	if (len)
+		*len = n;
+	return r->line;
+}
+
+void highlight_line(FILE* out, char* line, char* word, char* color) {
+	size_t len = strlen(line);
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		line[--len] = '\0';
+
+	char* save;
+	char* token = strtok_r(line, " ", &save);
+	while (token != NULL) {
+		if (strcasecmp(token, word) == 0) {
+			if (strcmp("r", color) == 0) {
+				fprintf(out, "\033[0;31m%s \033[0m", token);
+			}
+			else if (strcmp("g", color) == 0) {
+				fprintf(out, "\033[0;32m%s \033[0m", token);
+			}
+			else if (strcmp("b", color) == 0) {
+				fprintf(out, "\033[0;34m%s \033[0m", token);
+			}
+			else {
+				fprintf(out, "%s ", token);
+			}
+		}
+		else {
+			fprintf(out, "%s ", token);
+		}
+		token = strtok_r(NULL, " ", &save);
+	}
+	fputc('\n', out);
+}
+
+/*
+ * Line splitter for highlight -f: a trailing partial line is held back
+ * until its newline arrives so nothing is ever printed twice.
+ */
+struct follow_t {
+	char* word;
+	char* color;
+	char* pending;
+	size_t pending_len;
+	size_t pending_cap;
+};
+
+void follow_feed(struct follow_t* f, const unsigned char* buf, size_t len) {
+	while (len > 0) {
+		const unsigned char* nl = memchr(buf, '\n', len);
+		size_t take = nl ? (size_t)(nl - buf) + 1 : len;
+		if (f->pending_len + take + 1 > f->pending_cap) {
+			f->pending_cap = (f->pending_len + take + 1) * 2;
+			f->pending = realloc(f->pending, f->pending_cap);
+		}
+		memcpy(f->pending + f->pending_len, buf, take);
+		f->pending_len += take;
+		buf += take;
+		len -= take;
+		if (nl) {
+			f->pending[f->pending_len] = '\0';
+			highlight_line(stdout, f->pending, f->word, f->color);
+			f->pending_len = 0;
+		}
+	}
+}
+
+/*
+ * Feeds everything between *offset and the current end of file.
+ * A file smaller than *offset was truncated and is followed from the start.
+ */
+void follow_drain(struct follow_t* f, int fd, off_t* offset, unsigned char* buf) {
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size < *offset) {
+		fprintf(stderr, "-%s: highlight: file truncated\n", sysname);
+		*offset = 0;
+		f->pending_len = 0;
+	}
+	while (1) {
+		ssize_t n = pread(fd, buf, READER_CHUNK_SIZE, *offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		follow_feed(f, buf, n);
+		*offset += n;
+	}
+	fflush(stdout);
+}
+
+/*
+ * highlight -f: highlights the file like highlight does, then sleeps on
+ * inotify and highlights only what gets appended. A rotated file (renamed
+ * or deleted and recreated) is drained and the new file at the same path
+ * is followed from its start. Runs until Ctrl-C.
+ */
+int highlight_follow(char* path, char* word, char* color) {
+	struct follow_t f = { word, color, NULL, 0, 0 };
+	struct reader_t reader;
+	const unsigned char* chunk;
+	ssize_t n;
+	off_t offset = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return SUCCESS;
+	if (reader_open_fd(&reader, dup(fd), READER_CHUNK_SIZE) == 0) {
+		while ((n = reader_next(&reader, &chunk)) > 0) {
+			follow_feed(&f, chunk, n);
+			offset += n;
+		}
+		reader_close(&reader);
+	}
+	fflush(stdout);
+
+	char dir[PATH_MAX];
+	const char* base = strrchr(path, '/');
+	if (base) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(base - path) > 0 ? (int)(base - path) : 1, path);
+		base++;
+	}
+	else {
+		strcpy(dir, ".");
+		base = path;
+	}
+
+	int ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0) {
+		printf("-%s: highlight: %s\n", sysname, strerror(errno));
+		close(fd);
+		free(f.pending);
+		return SUCCESS;
+	}
+	int file_wd = inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+
+	// whatever was appended before the watch existed raised no event
+	unsigned char* buf = malloc(READER_CHUNK_SIZE);
+	follow_drain(&f, fd, &offset, buf);
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	// Ctrl+C arrives on the shell's signalfd; a forked child just dies of it
+	struct pollfd pfd[2] = { { ifd, POLLIN, 0 }, { loop.signal, POLLIN, 0 } };
+	while (1) {
+		if (poll(pfd, loop.active ? 2 : 1, -1) < 0)
+			continue;
+		if (loop.active && (pfd[1].revents & POLLIN) && loop_interrupted())
+			break;
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		ssize_t len = read(ifd, events, sizeof(events));
+		bool modified = false, rotated = false;
+		for (char* p = events; len > 0 && p < events + len;) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->wd == file_wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)))
+				rotated = true;
+			else if (ev->wd == file_wd)
+				modified = true;
+			else if (ev->len > 0 && strcmp(ev->name, base) == 0)
+				rotated = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+		if (modified || rotated)
+			follow_drain(&f, fd, &offset, buf);
+		if (!rotated)
+			continue;
+
+		// reopen only once a different file shows up under the path
+		struct stat old_st, new_st;
+		if (fstat(fd, &old_st) < 0 || stat(path, &new_st) < 0)
+			continue;
+		if (old_st.st_dev == new_st.st_dev && old_st.st_ino == new_st.st_ino)
+			continue;
+		int new_fd = open(path, O_RDONLY);
+		if (new_fd < 0)
+			continue;
+		if (f.pending_len > 0) // the old file's unterminated last line
+			follow_feed(&f, (const unsigned char*)"\n", 1);
+		inotify_rm_watch(ifd, file_wd);
+		close(fd);
+		fd = new_fd;
+		offset = 0;
+		file_wd = inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+		follow_drain(&f, fd, &offset, buf);
+	}
+
+	free(buf);
+	free(f.pending);
+	close(ifd);
+	close(fd);
+	return SUCCESS;
+}
+
+#define SEARCH_BINARY_PROBE 4096 // leading bytes checked for NUL
+
+/*
+ * One file of a multi-file highlight. Workers render matches into out;
+ * the shell prints the buffers in job order as they complete.
+ */
+struct search_job_t {
+	char* path;
+	char* out;
+	size_t out_len;
+	bool done;
+};
+
+/*
+ * Each worker owns a contiguous range of jobs and takes from its front;
+ * idle workers steal from the back of someone else's range.
+ */
+struct search_deque_t {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+};
+
+struct search_pool_t {
+	char* word;
+	char* color; // NULL for -l
+	struct search_job_t* jobs;
+	int job_count;
+	struct search_deque_t* deques;
+	int worker_count;
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	int stop; // set on Ctrl+C, read by the workers with __atomic
+};
+
+struct search_worker_t {
+	struct search_pool_t* pool;
+	int id;
+};
+
+/*
+ * Whole-token, case-insensitive match, using the same tokens as
+ * highlight_line without modifying the line.
+ */
+bool line_has_word(const char* line, const char* word) {
+	size_t wlen = strlen(word);
+	const char* p = line;
+	while ((p = strcasestr(p, word)) != NULL) {
+		char after = p[wlen];
+		if ((p == line || p[-1] == ' ')
+			&& (after == '\0' || after == ' ' || after == '\r' || after == '\n'))
+			return true;
+		p++;
+	}
+	return false;
+}
+
+void search_file(struct search_pool_t* pool, struct search_job_t* job) {
+	struct reader_t reader;
+	FILE* out = open_memstream(&job->out, &job->out_len);
+	if (reader_open(&reader, job->path) < 0) {
+		fprintf(stderr, "-%s: highlight: %s: %s\n", sysname, job->path, strerror(errno));
+		fclose(out);
+		return;
+	}
+
+	// look at the first chunk before handing it to reader_getline
+	ssize_t n = reader_next(&reader, &reader.cur);
+	if (n > 0 && memchr(reader.cur, '\0', n < SEARCH_BINARY_PROBE ? n : SEARCH_BINARY_PROBE) != NULL) {
+		reader_close(&reader);
+		fclose(out);
+		return;
+	}
+	reader.cur_len = n > 0 ? n : 0;
+	reader.cur_pos = 0;
+
+	char* line;
+	int line_number = 0;
+	while ((line = reader_getline(&reader, NULL)) != NULL && !__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) {
+		line_number++;
+		if (!line_has_word(line, pool->word))
+			continue;
+		if (pool->color == NULL) {
+			fprintf(out, "%s\n", job->path);
+			break;
+		}
+		fprintf(out, "%s:%d: ", job->path, line_number);
+		highlight_line(out, line, pool->word, pool->color);
+	}
+	reader_close(&reader);
+	fclose(out);
+}
+
+int search_take(struct search_pool_t* pool, int id) {
+	int job = -1;
+	if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED))
+		return -1;
+	for (int k = 0; k < pool->worker_count && job < 0; k++) {
+		struct search_deque_t* d = &pool->deques[(id + k) % pool->worker_count];
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail)
+			job = k == 0 ? d->head++ : --d->tail;
+		pthread_mutex_unlock(&d->lock);
+	}
+	return job;
+}
+
+void* search_worker(void* arg) {
+	struct search_worker_t* worker = arg;
+	struct search_pool_t* pool = worker->pool;
+	int job;
+	while ((job = search_take(pool, worker->id)) >= 0) {
+		search_file(pool, &pool->jobs[job]);
+		pthread_mutex_lock(&pool->done_lock);
+		pool->jobs[job].done = true;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->done_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Appends path to the job list, descending into directories (sorted by
+ * name) when recursive. Symlinked directories are not followed.
+ */
+void search_collect(char* path, bool recursive, bool top, struct search_job_t** jobs, int* count) {
+	struct stat st;
+	if ((top ? stat(path, &st) : lstat(path, &st)) < 0) {
+		fprintf(stderr, "-%s: highlight: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+	if (S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || !S_ISREG(st.st_mode)))
+		return;
+	if (S_ISDIR(st.st_mode)) {
+		if (loop_interrupted())
+			return;
+		if (!recursive) {
+			fprintf(stderr, "-%s: highlight: %s: Is a directory\n", sysname, path);
+			return;
+		}
+		struct dirent** entries;
+		int n = scandir(path, &entries, NULL, alphasort);
+		for (int i = 0; i < n; i++) {
+			char* name = entries[i]->d_name;
+			if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+				char* child = malloc(strlen(path) + strlen(name) + 2);
+				sprintf(child, "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", name);
+				search_collect(child, recursive, false, jobs, count);
+				free(child);
+			}
+			free(entries[i]);
+		}
+		if (n >= 0)
+			free(entries);
+		return;
+	}
+	if (!S_ISREG(st.st_mode) && !top)
+		return;
+	*jobs = realloc(*jobs, sizeof(struct search_job_t) * (*count + 1));
+	memset(&(*jobs)[*count], 0, sizeof(struct search_job_t));
+	(*jobs)[(*count)++].path = strdup(path);
+}
+
+/*
+ * highlight over several files and/or directories (-r): files are
+ * searched in parallel and matching lines are printed as
+ * file:line: text, in the order the files were given.
+ */
+int highlight_search(char* word, char* color, char** paths, int path_count, bool recursive) {
+	struct search_pool_t pool;
+	memset(&pool, 0, sizeof(pool));
+	pool.word = word;
+	pool.color = color;
+	for (int i = 0; i < path_count; i++)
+		search_collect(paths[i], recursive, true, &pool.jobs, &pool.job_count);
+	if (pool.job_count == 0 || loop_interrupted()) {
+		for (int i = 0; i < pool.job_count; i++)
+			free(pool.jobs[i].path);
+		free(pool.jobs);
+		return SUCCESS;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool.worker_count = cpus < 1 ? 1 : cpus > pool.job_count ? pool.job_count : cpus;
+	pool.deques = malloc(sizeof(struct search_deque_t) * pool.worker_count);
+	for (int w = 0; w < pool.worker_count; w++) {
+		pthread_mutex_init(&pool.deques[w].lock, NULL);
+		pool.deques[w].head = (long)pool.job_count * w / pool.worker_count;
+		pool.deques[w].tail = (long)pool.job_count * (w + 1) / pool.worker_count;
+	}
+	pthread_mutex_init(&pool.done_lock, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+
+	pthread_t* threads = malloc(sizeof(pthread_t) * pool.worker_count);
+	struct search_worker_t* workers = malloc(sizeof(struct search_worker_t) * pool.worker_count);
+	for (int w = 0; w < pool.worker_count; w++) {
+		workers[w].pool = &pool;
+		workers[w].id = w;
+		pthread_create(&threads[w], NULL, search_worker, &workers[w]);
+	}
+
+	// wake up now and then to look for Ctrl+C
+	for (int i = 0; i < pool.job_count && !pool.stop; i++) {
+		pthread_mutex_lock(&pool.done_lock);
+		while (!pool.jobs[i].done && !pool.stop) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&pool.done_cond, &pool.done_lock, &ts);
+			if (!pool.jobs[i].done && loop_interrupted())
+				__atomic_store_n(&pool.stop, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&pool.done_lock);
+		if (pool.stop || loop_interrupted())
+			break;
+		if (pool.jobs[i].out_len > 0)
+			fwrite(pool.jobs[i].out, 1, pool.jobs[i].out_len, stdout);
+	}
+	__atomic_store_n(&pool.stop, 1, __ATOMIC_RELAXED);
+	fflush(stdout);
+
+	for (int w = 0; w < pool.worker_count; w++) {
+		pthread_join(threads[w], NULL);
+		pthread_mutex_destroy(&pool.deques[w].lock);
+	}
+	for (int i = 0; i < pool.job_count; i++) {
+		free(pool.jobs[i].out);
+		free(pool.jobs[i].path);
+	}
+	pthread_mutex_destroy(&pool.done_lock);
+	pthread_cond_destroy(&pool.done_cond);
+	free(threads);
+	free(workers);
+	free(pool.deques);
+	free(pool.jobs);
+	return SUCCESS;
+}
+
+int highlight(int argc, char* argv[]) {
+	bool follow = false, recursive = false, list_only = false;
+	int first = 0;
+	for (; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; first++) {
+		for (char* o = argv[first] + 1; *o; o++) {
+			if (*o == 'f')
+				follow = true;
+			else if (*o == 'r')
+				recursive = true;
+			else if (*o == 'l')
+				list_only = true;
+			else {
+				printf("-%s: highlight: unknown option -%c\n", sysname, *o);
+				return SUCCESS;
+			}
+		}
+	}
+	argc -= first;
+	argv += first;
+	if (follow && (recursive || list_only)) {
+		printf("-%s: highlight: -f cannot be combined with -r or -l\n", sysname);
+		return SUCCESS;
+	}
+
+	// highlight -f word color file, or highlight [-r] [-l] word [color] file...; -l takes no color
+	int operands = list_only ? 1 : 2;
+	if (argc <= operands) {
+		return SUCCESS;
+	}
+	toLower(argv[0]);
+
+	if (follow && argc > 3) {
+		printf("-%s: highlight: -f follows a single file\n", sysname);
+		return SUCCESS;
+	}
+	if (follow) {
+		return highlight_follow(argv[2], argv[0], argv[1]);
+	}
+	if (recursive || list_only || argc > 3) {
+		return highlight_search(argv[0], list_only ? NULL : argv[1], argv + operands, argc - operands, recursive);
+	}
+
+	struct reader_t reader;
+	if (reader_open(&reader, argv[2]) < 0) {
+		return SUCCESS;
+	}
+
+	char* line;
+	unsigned long lines = 0;
+	while ((line = reader_getline(&reader, NULL)) != NULL) {
+		if ((++lines & 4095) == 0 && loop_interrupted())
+			break;
+		highlight_line(stdout, line, argv[0], argv[1]);
+	}
+	reader_close(&reader);
+	return SUCCESS;
+}
+
+int shortdirDelete(char* n) {
+	struct reader_t reader;
+	FILE* out = fopen(name2, "w");
+	if (!out) {
+		perror("fopen");
+		return SUCCESS;
+	}
+
+	if (reader_open(&reader, name) == 0) {
+		char* line;
+		while ((line = reader_getline(&reader, NULL)) != NULL) {
+			size_t key = strcspn(line, ":");
+			if (strlen(n) != key || strncmp(line, n, key) != 0) {
+				fputs(line, out);
+			}
+		}
+		reader_close(&reader);
+	}
+	fclose(out);
+
+	if (rename(name2, name) < 0)
+		perror("rename");
+
+	return SUCCESS;
+}
+
+int shortdir(int argc, char* argv[]) {
+
+	if (argc == 2) {
+		if (strcmp(argv[0], "set") == 0) {
+			shortdirDelete(argv[1]);
+			getcwd(cwd, sizeof(cwd));
+			FILE* out = fopen(name, "a");
+			if (!out) {
+				perror("fopen");
+				return SUCCESS;
+			}
+			fprintf(out, "%s:%s\n", argv[1], cwd);
+			fclose(out);
+			return SUCCESS;
+		}
+		else if (strcmp(argv[0], "jump") == 0) {
+			struct reader_t reader;
+			if (reader_open(&reader, name) == 0) {
+				char* line;
+				while ((line = reader_getline(&reader, NULL)) != NULL) {
+					char* save;
+					char* token = strtok_r(line, ":", &save);
+					if (strcmp(token, argv[1]) == 0) {
+						token = strtok_r(NULL, "\n", &save);
+						if (token != NULL)
+							chdir(token);
+
+						getcwd(cwd, sizeof(cwd));
+						reader_close(&reader);
+						return SUCCESS;
+					}
+				}
+				reader_close(&reader);
+			}
+
+			printf("There is no any shortdir called: %s\n", argv[1]);
+			return SUCCESS;
+		}
+		else if (strcmp(argv[0], "del") == 0) {
+			return shortdirDelete(argv[1]);
+		}
+	}
+	else if (argc == 1) {
+		if (strcmp(argv[0], "clear") == 0) {
+			FILE* out = fopen(name, "w");
+			if (!out)
+				perror("fopen");
+			else
+				fclose(out);
+			return SUCCESS;
+		}
+		else if (strcmp(argv[0], "list") == 0) {
+			struct reader_t reader;
+			if (reader_open(&reader, name) < 0) {
+				return SUCCESS;
+			}
+
+			char* line;
+			while ((line = reader_getline(&reader, NULL)) != NULL) {
+				char* save;
+				char* token = strtok_r(line, ":", &save);
+				printf("%s -> ", token);
+				token = strtok_r(NULL, ":", &save);
+				printf("%s\n", token);
+			}
+			reader_close(&reader);
+			return SUCCESS;
+		}
+
+	}
+	return EXIT;
+}
+
+/*
+ * Length of the file behind a reader that has handed out `seen` bytes.
+ * Files without a usable size (procfs, pipes) are read to their end.
+ */
+unsigned long reader_length(struct reader_t* r, unsigned long seen) {
+	const unsigned char* buf;
+	ssize_t n;
+	if (!r->stream && r->size > 0)
+		return r->size > (off_t)seen ? (unsigned long)r->size : seen;
+	while ((n = reader_next(r, &buf)) > 0)
+		seen += n;
+	return seen;
+}
+
+void compare_bytes(char* file1, char* file2) {
+	struct reader_t r1, r2;
+	if (reader_open(&r1, file1) < 0) {
+		printf("Missing file\n");
+		return;
+	}
+	if (reader_open(&r2, file2) < 0) {
+		reader_close(&r1);
+		printf("Missing file\n");
+		return;
+	}
+
+	unsigned long pos = 0;
+	int c1 = EOF, c2 = EOF;
+	const unsigned char* b1, * b2;
+	ssize_t n1 = 0, n2 = 0, i1 = 0, i2 = 0;
+	bool interrupted = false;
+	while (1) {
+		if ((i1 == n1 || i2 == n2) && (interrupted = loop_interrupted()))
+			break;
+		if (i1 == n1) {
+			n1 = reader_next(&r1, &b1);
+			i1 = 0;
+		}
+		if (i2 == n2) {
+			n2 = reader_next(&r2, &b2);
+			i2 = 0;
+		}
+		if (n1 <= 0 || n2 <= 0) {
+			c1 = n1 > 0 ? b1[i1] : EOF;
+			c2 = n2 > 0 ? b2[i2] : EOF;
+			break;
+		}
+		ssize_t run = n1 - i1 < n2 - i2 ? n1 - i1 : n2 - i2;
+		if (memcmp(b1 + i1, b2 + i2, run) != 0) {
+			while (b1[i1] == b2[i2]) {
+				i1++;
+				i2++;
+				pos++;
+			}
+			c1 = b1[i1];
+			c2 = b2[i2];
+			break;
+		}
+		i1 += run;
+		i2 += run;
+		pos += run;
+	}
+
+	if (interrupted) {
+		reader_close(&r1);
+		reader_close(&r2);
+		return;
+	}
+	if (c1 == c2) {
+		printf("The two files are identical\n");
+	}
+	else {
+		unsigned long size1 = reader_length(&r1, n1 > 0 ? pos - i1 + n1 : pos);
+		unsigned long size2 = reader_length(&r2, n2 > 0 ? pos - i2 + n2 : pos);
+		unsigned long size = size1 > size2 ? size1 : size2;
+		printf("The two files are different in %lu bytes\n", size - pos);
+		printf("file1 and file2 differ at position %lu: 0x%X <> 0x%X\n", pos, c1, c2);
+	}
+	reader_close(&r1);
+	reader_close(&r2);
+}
+
+#define KDIFF_BLOCK_SIZE (1 << 20) // bytes covered by one block hash
+#define KDIFF_CACHE_MAGIC 0x3146444bU // "KDF1"
+#define KDIFF_CACHE_MAX_BYTES (16 << 20) // evict least recently used entries past this
+
+/*
+ * kdiff cache file layout: a kdiff_cache_header followed by count entries,
+ * each a kdiff_cache_entry immediately followed by block_count block hashes.
+ * An entry is valid for a file while (dev, ino, size, mtime_ns) still match.
+ */
+struct kdiff_cache_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint64_t count;
+};
+
+struct kdiff_cache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t hash;
+	uint64_t last_used;
+	uint64_t block_count;
+};
+
+struct fingerprint_t {
+	struct kdiff_cache_entry key;
+	uint64_t* blocks;
+	bool from_cache;
+};
+
+struct kdiff_cache_t {
+	int fd;
+	unsigned char* map;
+	size_t map_size;
+};
+
+uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Fast non-cryptographic 64-bit hash, four independent lanes over 32 byte
+ * stripes so the multiplies pipeline.
+ */
+uint64_t hash_bytes(const unsigned char* buf, size_t len, uint64_t seed) {
+	const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t lane[4] = { seed + p1, seed ^ p2, seed - p1, seed + p2 };
+	uint64_t w, h;
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			memcpy(&w, buf + i + 8 * l, 8);
+			lane[l] = rotl64(lane[l] + w * p2, 31) * p1;
+		}
+	}
+	h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+	h ^= len * p1;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		h = rotl64(h ^ (w * p2), 27) * p1;
+	}
+	for (; i < len; i++)
+		h = rotl64(h ^ (buf[i] * p1), 11) * p2;
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	h *= p1;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t stat_mtime_ns(struct stat* st) {
+	return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t kdiff_entry_size(struct kdiff_cache_entry* e) {
+	return sizeof(struct kdiff_cache_entry) + e->block_count * sizeof(uint64_t);
+}
+
+/*
+ * Maps the cache file shared so hits can bump last_used in place.
+ * A missing or malformed cache file is treated as empty.
+ */
+void kdiff_cache_load(struct kdiff_cache_t* cache) {
+	struct stat st;
+	cache->map = NULL;
+	cache->map_size = 0;
+	cache->fd = open(name3, O_RDWR);
+	if (cache->fd < 0)
+		return;
+	if (fstat(cache->fd, &st) < 0 || st.st_size < (off_t)sizeof(struct kdiff_cache_header))
+		return;
+	void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	struct kdiff_cache_header* header = map;
+	if (header->magic != KDIFF_CACHE_MAGIC || header->block_size != KDIFF_BLOCK_SIZE) {
+		munmap(map, st.st_size);
+		return;
+	}
+	cache->map = map;
+	cache->map_size = st.st_size;
+}
+
+void kdiff_cache_close(struct kdiff_cache_t* cache) {
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+	if (cache->fd >= 0)
+		close(cache->fd);
+	cache->map = NULL;
+	cache->fd = -1;
+}
+
+/*
+ * Returns the mapped entry at *offset and advances past it, or NULL at the
+ * end of the cache or on a truncated entry.
+ */
+struct kdiff_cache_entry* kdiff_cache_next(struct kdiff_cache_t* cache, size_t* offset) {
+	if (*offset == 0)
+		*offset = sizeof(struct kdiff_cache_header);
+	if (*offset + sizeof(struct kdiff_cache_entry) > cache->map_size)
+		return NULL;
+	struct kdiff_cache_entry* e = (struct kdiff_cache_entry*)(cache->map + *offset);
+	if (e->block_count > (cache->map_size - *offset) / sizeof(uint64_t)
+		|| *offset + kdiff_entry_size(e) > cache->map_size)
+		return NULL;
+	*offset += kdiff_entry_size(e);
+	return e;
+}
+
+bool kdiff_cache_find(struct kdiff_cache_t* cache, struct fingerprint_t* fp) {
+	struct kdiff_cache_entry* e;
+	size_t offset = 0;
+	if (!cache->map)
+		return false;
+	while ((e = kdiff_cache_next(cache, &offset)) != NULL) {
+		if (e->dev == fp->key.dev && e->ino == fp->key.ino
+			&& e->size == fp->key.size && e->mtime_ns == fp->key.mtime_ns) {
+			e->last_used = now_ns();
+			fp->key = *e;
+			fp->blocks = (uint64_t*)(e + 1);
+			fp->from_cache = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+int compare_last_used(const void* a, const void* b) {
+	uint64_t x = (*(struct kdiff_cache_entry**)a)->last_used;
+	uint64_t y = (*(struct kdiff_cache_entry**)b)->last_used;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Rewrites the cache with the new fingerprints plus the surviving old
+ * entries, most recently used first, dropping whatever does not fit.
+ */
+void kdiff_cache_store(struct kdiff_cache_t* cache, struct fingerprint_t* fps, int n) {
+	struct kdiff_cache_entry** entries = NULL;
+	int count = 0;
+	size_t offset = 0;
+	struct kdiff_cache_entry* e;
+
+	for (int i = 0; i < n; i++) {
+		if (fps[i].from_cache)
+			continue;
+		e = malloc(kdiff_entry_size(&fps[i].key));
+		*e = fps[i].key;
+		memcpy(e + 1, fps[i].blocks, e->block_count * sizeof(uint64_t));
+		entries = realloc(entries, sizeof(*entries) * (count + 1));
+		entries[count++] = e;
+	}
+	while (cache->map && (e = kdiff_cache_next(cache, &offset)) != NULL) {
+		bool replaced = false;
+		for (int i = 0; i < n; i++)
+			if (e->dev == fps[i].key.dev && e->ino == fps[i].key.ino && !fps[i].from_cache)
+				replaced = true;
+		if (replaced)
+			continue;
+		entries = realloc(entries, sizeof(*entries) * (count + 1));
+		entries[count++] = e;
+	}
+	qsort(entries, count, sizeof(*entries), compare_last_used);
+
+	// per process, so two shells saving at once do not share a file
+	char tmp[PATH_MAX + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name3, getpid());
+	FILE* out = fopen(tmp, "wb");
+	if (out != NULL) {
+		struct kdiff_cache_header header = { KDIFF_CACHE_MAGIC, KDIFF_BLOCK_SIZE, 0 };
+		size_t total = sizeof(header);
+		int kept = 0;
+		while (kept < count && total + kdiff_entry_size(entries[kept]) <= KDIFF_CACHE_MAX_BYTES)
+			total += kdiff_entry_size(entries[kept++]);
+		header.count = kept;
+		fwrite(&header, sizeof(header), 1, out);
+		for (int i = 0; i < kept; i++)
+			fwrite(entries[i], kdiff_entry_size(entries[i]), 1, out);
+		if (fclose(out) == 0)
+			rename(tmp, name3);
+		else
+			unlink(tmp);
+	}
+
+	for (int i = 0; i < count; i++)
+		if ((unsigned char*)entries[i] < cache->map || (unsigned char*)entries[i] >= cache->map + cache->map_size)
+			free(entries[i]);
+	free(entries);
+}
+
+/*
+ * Reads the whole file once, hashing every block. The full-file hash is a
+ * hash over the block hashes so it never needs a second pass.
+ */
+int fingerprint_file(int fd, struct fingerprint_t* fp) {
+	struct reader_t reader;
+	const unsigned char* buf;
+	uint64_t count = (fp->key.size + KDIFF_BLOCK_SIZE - 1) / KDIFF_BLOCK_SIZE;
+	fp->blocks = malloc(sizeof(uint64_t) * (count ? count : 1));
+	fp->key.block_count = count;
+	if (reader_open_fd(&reader, dup(fd), KDIFF_BLOCK_SIZE) < 0)
+		return -1;
+	// the reader hands out chunks aligned to KDIFF_BLOCK_SIZE
+	for (uint64_t b = 0; b < count; b++) {
+		ssize_t got = loop_interrupted() ? -1 : reader_next(&reader, &buf);
+		if (got <= 0) {
+			reader_close(&reader);
+			return -1;
+		}
+		fp->blocks[b] = hash_bytes(buf, got, b);
+	}
+	reader_close(&reader);
+	fp->key.hash = hash_bytes((unsigned char*)fp->blocks, count * sizeof(uint64_t), fp->key.size);
+	fp->key.last_used = now_ns();
+	return 0;
+}
+
+/*
+ * Finds the first differing byte inside block b. Returns false if the
+ * block contents turn out to be equal (a block hash collision).
+ */
+bool diff_in_block(int fd1, int fd2, uint64_t b, unsigned long* pos, int* c1, int* c2) {
+	unsigned char* buf1 = malloc(KDIFF_BLOCK_SIZE);
+	unsigned char* buf2 = malloc(KDIFF_BLOCK_SIZE);
+	ssize_t n1 = pread(fd1, buf1, KDIFF_BLOCK_SIZE, b * KDIFF_BLOCK_SIZE);
+	ssize_t n2 = pread(fd2, buf2, KDIFF_BLOCK_SIZE, b * KDIFF_BLOCK_SIZE);
+	bool found = false;
+	if (n1 < 0) n1 = 0;
+	if (n2 < 0) n2 = 0;
+	for (ssize_t i = 0; i < n1 || i < n2; i++) {
+		*c1 = i < n1 ? buf1[i] : EOF;
+		*c2 = i < n2 ? buf2[i] : EOF;
+		if (*c1 != *c2) {
+			*pos = b * KDIFF_BLOCK_SIZE + i;
+			found = true;
+			break;
+		}
+	}
+	free(buf1);
+	free(buf2);
+	return found;
+}
+
+/*
+ * kdiff -bc: binary compare backed by the fingerprint cache. Unchanged
+ * files are answered from their cached hashes without being read, and
+ * only blocks whose hashes differ are read back to locate the difference.
+ */
+void compare_bytes_cached(char* file1, char* file2) {
+	char* files[2] = { file1, file2 };
+	int fds[2];
+	struct fingerprint_t fps[2];
+	struct kdiff_cache_t cache;
+	struct stat st;
+
+	memset(fps, 0, sizeof(fps));
+	fds[0] = open(file1, O_RDONLY);
+	fds[1] = open(file2, O_RDONLY);
+	if (fds[0] < 0 || fds[1] < 0) {
+		printf("Missing file\n");
+		if (fds[0] >= 0) close(fds[0]);
+		if (fds[1] >= 0) close(fds[1]);
+		return;
+	}
+	// only regular files with a size can be split into blocks; procfs
+	// files (size 0), devices and pipes are compared by reading them
+	for (int i = 0; i < 2; i++) {
+		if (fstat(fds[i], &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			close(fds[0]);
+			close(fds[1]);
+			compare_bytes(file1, file2);
+			return;
+		}
+	}
+
+	kdiff_cache_load(&cache);
+	for (int i = 0; i < 2; i++) {
+		fstat(fds[i], &st);
+		fps[i].key.dev = st.st_dev;
+		fps[i].key.ino = st.st_ino;
+		fps[i].key.size = st.st_size;
+		fps[i].key.mtime_ns = stat_mtime_ns(&st);
+		if (kdiff_cache_find(&cache, &fps[i]))
+			continue;
+		if (fingerprint_file(fds[i], &fps[i]) < 0) {
+			if (!loop_interrupted())
+				printf("-%s: kdiff: %s: read error\n", sysname, files[i]);
+			goto out;
+		}
+	}
+	if (!fps[0].from_cache || !fps[1].from_cache)
+		kdiff_cache_store(&cache, fps, 2);
+
+	unsigned long pos = 0;
+	int c1 = EOF, c2 = EOF;
+	bool differ = false;
+	if (fps[0].key.size != fps[1].key.size || fps[0].key.hash != fps[1].key.hash) {
+		uint64_t n1 = fps[0].key.block_count, n2 = fps[1].key.block_count;
+		for (uint64_t b = 0; b < n1 || b < n2; b++) {
+			if (b < n1 && b < n2 && fps[0].blocks[b] == fps[1].blocks[b])
+				continue;
+			if ((differ = diff_in_block(fds[0], fds[1], b, &pos, &c1, &c2)))
+				break;
+		}
+	}
+
+	if (!differ) {
+		printf("The two files are identical\n");
+	}
+	else {
+		uint64_t size = fps[0].key.size > fps[1].key.size ? fps[0].key.size : fps[1].key.size;
+		printf("The two files are different in %lu bytes\n", (unsigned long)(size - pos));
+		printf("file1 and file2 differ at position %lu: 0x%X <> 0x%X\n", pos, c1, c2);
+	}
+
+out:
+	for (int i = 0; i < 2; i++)
+		if (!fps[i].from_cache)
+			free(fps[i].blocks);
+	kdiff_cache_close(&cache);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int kdiff(int argc, char* argv[]) {
+	int ff = 1;
+	int sf = 2;
+	int i = 1, j = 1;
+	bool binary = strcmp(argv[0], "-b") == 0 || strcmp(argv[0], "-bc") == 0;
+	if (argc == 2) {
+		ff = 0;
+		sf = 1;
+	}
+	char* ext = strchr(argv[ff], '.');
+	if (ext != NULL) {
+		i = strcmp(ext + 1, "txt");
+	}
+	char* ext1 = strchr(argv[sf], '.');
+	if (ext != NULL) {
+		j = strcmp(ext1 + 1, "txt");
+	}
+
+	if ((i != 0 || j != 0) && !binary) {
+		printf("Try again\n");
+		return SUCCESS;
+	}
+	if (argc >= 2) {
+
+		int counter = 0;
+		int line = 0;
+		if (!binary) {
+			if (i == 0 && j == 0) {
+				struct reader_t r1, r2;
+				if (reader_open(&r1, argv[ff]) < 0) {
+					printf("Missing file\n");
+					return SUCCESS;
+				}
+				if (reader_open(&r2, argv[sf]) < 0) {
+					reader_close(&r1);
+					printf("Missing file\n");
+					return SUCCESS;
+				}
+				char* line1 = reader_getline(&r1, NULL);
+				char* line2 = reader_getline(&r2, NULL);
+				while (line1 != NULL && line2 != NULL) {
+					line++;
+					if ((line & 4095) == 0 && loop_interrupted())
+						break;
+					if (strcmp(line1, line2) != 0) {
+						printf("%s:Line %d: %s\n", argv[ff], line, line1);
+						printf("%s:Line %d: %s\n", argv[sf], line, line2);
+						counter++;
+					}
+					line1 = reader_getline(&r1, NULL);
+					line2 = reader_getline(&r2, NULL);
+				}
+
+				for (; line1 != NULL && !loop.interrupted; line1 = reader_getline(&r1, NULL)) {
+					line++;
+					printf("%s:Line %d: %s\n", argv[ff], line, line1);
+					counter++;
+				}
+
+				for (; line2 != NULL && !loop.interrupted; line2 = reader_getline(&r2, NULL)) {
+					line++;
+					printf("%s:Line %d: %s\n", argv[sf], line, line2);
+					counter++;
+				}
+
+				if (counter != 0) {
+					printf("%d different lines found\n", counter);
+				}
+				else {
+					printf("The two files are identical\n");
+				}
+				reader_close(&r1);
+				reader_close(&r2);
+			}
+			else {
+				printf("Error on kdiff\n");
+			}
+		}
+		else if (strcmp(argv[0], "-bc") == 0 && name3[0] != '\0') {
+			compare_bytes_cached(argv[1], argv[2]);
+		}
+		else {
+			compare_bytes(argv[1], argv[2]);
+		}
+
+
+	}
+	else {
+		printf("Error on kdiff\n");
+	}
+
+	return SUCCESS;
+}
+
+int donkeySay(int argc, char* argv[]) {
+	if (argc < 1) {
+		return SUCCESS;
+	}
+	printf(" ____________\n");
+	printf("< %s >\n", argv[0]);
+	printf(" ------------\n");
+	printf("        \\   ^__^\n");
+	printf("         \\  (oo)\\_______\n");
+	printf("            (__)\\       )\\/\\\n");
+	printf("                ||-----||\n");
+	printf("                ||     ||\n");
+	printf("============================\n");
+	printf("COMP304COMP304COMP304COMP304\n");
+	return SUCCESS;
+}
+
+int highLowGame(int argc, char* argv[]) {
+	char input[20];
+	memset(input, '\0', sizeof(input));
+	int coin = 50;
+	int bet = 2;
+	srand(time(NULL));
+	int start = 1;
+	int toCompare = rand() % 10 + 1;
+	int compared = 5;
+	while (strcmp(input, "exit\n") != 0 && coin > 0)
+	{
+		if (strcmp(input, "change bet\n") == 0) {
+			printf("Please enter your desired bet: ");
+			scanf("%d", &bet);
+			printf("Enter your guess: ");
+			scanf("%s", input);
+			coin = coin + bet;
+		}
+		else {
+			printf("\033[2J\n");
+			if (!start) {
+				printf("The number was %d\n", toCompare);
+			}
+			if (start) {
+				printf("Guess high or low\n");
+				printf("If you guess right, you win 2 coins else you lose 2 coins\n");
+				start = 0;
+			}
+			else if (compared > toCompare && strcmp(input, "high\n") == 0) {
+				printf("You guess right!\n");
+				coin = coin + bet;
+			}
+			else if (compared < toCompare && strcmp(input, "low\n") == 0) {
+				printf("You guess right!\n");
+				coin = coin + bet;
+			}
+			else {
+				if (!start && strcmp(input, "change bet\n") != 0) {
+					printf("You guess wrong!\n");
+					coin = coin - bet;
+				}
+			}
+			toCompare = compared;
+			compared = rand() % 10 + 1;
+			printf("Coin: %d\n", coin);
+			printf("Bet: %d\n", bet);
+
+			printf("Number %d\n", toCompare);
+			printf("Enter your guess: ");
+			fgets(input, 99, stdin);
+		}
+	}
+	if (coin <= 0) {
+		printf("Bankrupt coin: %d\n", coin);
+	}
+	printf("End of the Game\n");
+	return SUCCESS;
+}
+
+
+
+int last_status; // exit status of the last command, $?
+struct strvec_t* positional; // $1.. of the running function, NULL at top level
+
+struct function_t {
+	char* name;
+	struct node_t* body;
+	struct function_t* next;
+};
+
+struct function_t* functions;
+
+struct function_t* find_function(const char* name)
+{
+	for (struct function_t* f = functions; f; f = f->next)
+		if (strcmp(f->name, name) == 0)
+			return f;
+	return NULL;
+}
+
+void define_function(const char* name, struct node_t* body)
+{
+	struct function_t* f = find_function(name);
+	if (f == NULL)
+	{
+		f = calloc(1, sizeof(struct function_t));
+		f->name = strdup(name);
+		f->next = functions;
+		functions = f;
+	}
+	else
+		free_node(f->body);
+	f->body = body;
+	if (body)
+		body->refs++;
+}
+
+/*
+ * Appends value to the word being built. Unquoted expansions are split
+ * on blanks, each blank run ending the current word.
+ */
+void expand_append(struct strvec_t* out, char** cur, size_t* len, bool* has_word, const char* value, bool split)
+{
+	for (const char* p = value; *p; p++)
+	{
+		if (split && (*p == ' ' || *p == '\t' || *p == '\n'))
+		{
+			if (*has_word)
+			{
+				strvec_push(out, strndup(*cur, *len));
+				*len = 0;
+				*has_word = false;
+			}
+			continue;
+		}
+		*cur = realloc(*cur, *len + 2);
+		(*cur)[(*len)++] = *p;
+		*has_word = true;
+	}
+}
+
+void expand_word(struct word_t* w, struct strvec_t* out)
+{
+	if (w->text)
+	{
+		strvec_push(out, strdup(w->text));
+		return;
+	}
+
+	char* cur = NULL;
+	size_t len = 0;
+	bool has_word = false;
+	char number[16];
+	for (int i = 0; i < w->part_count; i++)
+	{
+		struct segment_t* seg = &w->parts[i];
+		const char* value = "";
+		switch (seg->kind)
+		{
+		case SEG_TEXT:
+			value = seg->text;
+			break;
+		case SEG_VAR:
+			value = var_get(seg->var);
+			break;
+		case SEG_ARG:
+			if (seg->index == 0)
+				value = sysname;
+			else if (positional && seg->index <= positional->count)
+				value = positional->items[seg->index - 1];
+			break;
+		case SEG_ARGC:
+			snprintf(number, sizeof(number), "%d", positional ? positional->count : 0);
+			value = number;
+			break;
+		case SEG_STATUS:
+			snprintf(number, sizeof(number), "%d", last_status);
+			value = number;
+			break;
+		case SEG_ARGS:
+			// "$@" keeps every argument a separate word
+			for (int a = 0; positional && a < positional->count; a++)
+			{
+				if (a > 0 && (seg->quoted || has_word))
+				{
+					strvec_push(out, strndup(cur ? cur : "", len));
+					len = 0;
+					has_word = false;
 				}
-				else {
-					printf("%s ", token);
+				expand_append(out, &cur, &len, &has_word, positional->items[a], !seg->quoted);
+				if (seg->quoted)
+					has_word = true;
+			}
+			continue;
+		}
+		expand_append(out, &cur, &len, &has_word, value, !seg->quoted);
+		if (seg->quoted)
+			has_word = true;
+	}
+	if (has_word)
+		strvec_push(out, strndup(cur ? cur : "", len));
+	free(cur);
+}
+
+bool is_assignment(const char* word)
+{
+	const char* eq = strchr(word, '=');
+	if (eq == NULL || eq == word)
+		return false;
+	for (const char* p = word; p < eq; p++)
+		if (!is_name_char(*p, p == word))
+			return false;
+	return true;
+}
+
+int execute_node(struct node_t* node);
+
+/*
+ * Runs a subtree with no single process of its own (a group, a loop,
+ * a function call) as a background job in a forked shell
+ */
+int run_background(struct node_t* node)
+{
+	const char* labels[] = { node->word_count && node->words[0].text ? node->words[0].text : "function call", "{ ... }", "... && ...", "... || ...",
+		"if ...", "while ...", "for ...", "function definition" };
+	fflush(stdout); // the child must not inherit pending output
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		child_setup(0, false);
+		node->background = false;
+		execute_node(node);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	job_start(pid, 0, false);
+	if (loop.active)
+		jobs_add(pid, pid, strdup(node->type == NODE_WHILE && node->until ? "until ..." : labels[node->type]), false);
+	last_status = 0;
+	return SUCCESS;
+}
+
+int execute_simple(struct node_t* node)
+{
+	struct strvec_t argv = { NULL, 0, 0 };
+	bool* operators = NULL;
+	int code = SUCCESS;
+	for (int i = 0; i < node->word_count; i++)
+	{
+		int first = argv.count;
+		if (node->words[i].op)
+			strvec_push(&argv, strdup(node->words[i].op));
+		else
+			expand_word(&node->words[i], &argv);
+		operators = realloc(operators, sizeof(bool) * (argv.count + 1));
+		for (int k = first; k < argv.count; k++)
+			operators[k] = node->words[i].op != NULL;
+	}
+
+	if (argv.count == 0)
+	{
+		last_status = 0;
+	}
+	else if (argv.count == 1 && is_assignment(argv.items[0]))
+	{
+		char* eq = strchr(argv.items[0], '=');
+		var_set(var_lookup(argv.items[0], eq - argv.items[0]), eq + 1);
+		last_status = 0;
+	}
+	else if (strcmp(argv.items[0], "break") == 0 || strcmp(argv.items[0], "continue") == 0)
+	{
+		last_status = 0;
+		code = argv.items[0][0] == 'b' ? LOOP_BREAK : LOOP_CONTINUE;
+	}
+	else if (strcmp(argv.items[0], "return") == 0)
+	{
+		last_status = argv.count > 1 ? atoi(argv.items[1]) : last_status;
+		code = FUNC_RETURN;
+	}
+	else if (find_function(argv.items[0]) != NULL && node->background)
+	{
+		code = run_background(node);
+	}
+	else if (find_function(argv.items[0]) != NULL)
+	{
+		struct function_t* f = find_function(argv.items[0]);
+		struct strvec_t args = { argv.items + 1, argv.count - 1, 0 };
+		struct strvec_t* saved = positional;
+		struct node_t* body = f->body;
+		positional = &args;
+		if (body)
+			body->refs++; // the function may redefine itself
+		code = execute_node(body);
+		free_node(body);
+		positional = saved;
+		if (code == FUNC_RETURN)
+			code = SUCCESS;
+	}
+	else
+	{
+		struct command_t* command = malloc(sizeof(struct command_t));
+		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+		parse_command(argv.items, operators, argv.count, command);
+		for (struct command_t* c = command; c; c = c->next)
+			c->background = node->background;
+		code = process_command(command);
+		free_command(command);
+	}
+	if (code == SUCCESS && loop_interrupted())
+	{
+		// stop the enclosing lists and loops too
+		if (last_status == 0)
+			last_status = 130;
+		code = INTERRUPTED;
+	}
+	strvec_free(&argv);
+	free(operators);
+	return code;
+}
+
+/*
+ * Runs a syntax tree. Returns SUCCESS, EXIT, or one of the
+ * LOOP_BREAK/LOOP_CONTINUE/FUNC_RETURN codes while unwinding; the
+ * command status is left in last_status.
+ */
+int execute_node(struct node_t* node)
+{
+	int code;
+	if (node == NULL)
+	{
+		last_status = 0;
+		return SUCCESS;
+	}
+
+	if (node->background && node->type != NODE_COMMAND)
+		return run_background(node);
+
+	switch (node->type)
+	{
+	case NODE_COMMAND:
+		return execute_simple(node);
+	case NODE_LIST:
+		code = execute_node(node->left);
+		return code != SUCCESS ? code : execute_node(node->right);
+	case NODE_AND:
+	case NODE_OR:
+		code = execute_node(node->left);
+		if (code != SUCCESS || (last_status == 0) != (node->type == NODE_AND))
+			return code;
+		return execute_node(node->right);
+	case NODE_IF:
+		code = execute_node(node->left);
+		if (code != SUCCESS)
+			return code;
+		if (last_status == 0)
+			return execute_node(node->right);
+		if (node->other)
+			return execute_node(node->other);
+		last_status = 0;
+		return SUCCESS;
+	case NODE_WHILE:
+	{
+		int status = 0;
+		while (1)
+		{
+			code = execute_node(node->left);
+			if (code != SUCCESS)
+				return code;
+			if ((last_status == 0) == node->until)
+				break;
+			code = execute_node(node->right);
+			status = last_status;
+			if (code == LOOP_BREAK)
+				break;
+			if (code != SUCCESS && code != LOOP_CONTINUE)
+				return code;
+		}
+		last_status = status;
+		return SUCCESS;
+	}
+	case NODE_FOR:
+	{
+		struct strvec_t items = { NULL, 0, 0 };
+		for (int i = 0; i < node->word_count; i++)
+			expand_word(&node->words[i], &items);
+		code = SUCCESS;
+		last_status = 0;
+		for (int i = 0; i < items.count; i++)
+		{
+			var_set(node->var, items.items[i]);
+			code = execute_node(node->right);
+			if (code == LOOP_CONTINUE)
+				code = SUCCESS;
+			if (code != SUCCESS)
+				break;
+		}
+		strvec_free(&items);
+		return code == LOOP_BREAK ? SUCCESS : code;
+	}
+	case NODE_FUNCTION:
+		define_function(node->name, node->right);
+		last_status = 0;
+		return SUCCESS;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Returns a pipe whose read end yields data, for here-strings and
+ * here-documents. Small bodies fit the pipe buffer and are written
+ * right away; larger ones are fed by a detached writer process.
+ */
+int pipe_input(const char* data, size_t len)
+{
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1)
+		return -1;
+	if (len > 65536)
+		fcntl(p[1], F_SETPIPE_SZ, len); // best effort, capped by pipe-max-size
+	int size = fcntl(p[1], F_GETPIPE_SZ);
+	if (size < 0 || len > (size_t)size)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			loop_leave();
+			if (fork() == 0) // reparented, so nobody has to wait for it
+			{
+				close(p[0]);
+				for (size_t done = 0; done < len;)
+				{
+					ssize_t n = write(p[1], data + done, len - done);
+					if (n <= 0)
+						break;
+					done += n;
 				}
-				token = strtok(NULL, " ");
 			}
-			printf("\n");
+			_exit(0);
 		}
-		fclose(fp);
+		waitpid(pid, NULL, 0);
+	}
+	else if (write(p[1], data, len) != (ssize_t)len)
+	{
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	close(p[1]);
+	return p[0];
+}
+
+/*
+ * Applies one redirection to the current process. Errors are reported
+ * on stderr and leave the target descriptor untouched.
+ */
+int apply_redirect(struct redirect_t* r)
+{
+	int fd = -1;
+	int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	if (r->target[0] == '\0' && r->type != REDIRECT_STRING)
+	{
+		fprintf(stderr, "-%s: ambiguous redirect\n", sysname);
+		return -1;
+	}
+	switch (r->type)
+	{
+	case REDIRECT_INPUT:
+		fd = open(r->target, O_RDONLY | O_CLOEXEC);
+		break;
+	case REDIRECT_OUTPUT:
+		fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+		break;
+	case REDIRECT_APPEND:
+		fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, mode);
+		break;
+	case REDIRECT_STRING:
+	{
+		size_t len = strlen(r->target);
+		char* data = malloc(len + 1);
+		memcpy(data, r->target, len);
+		data[len] = '\n';
+		fd = pipe_input(data, len + 1);
+		free(data);
+		break;
+	}
+	case REDIRECT_DUP:
+	{
+		if (strcmp(r->target, "-") == 0)
+		{
+			close(r->fd);
+			return 0;
+		}
+		char* end;
+		long m = strtol(r->target, &end, 10);
+		if (r->target[0] == '\0' || *end != '\0' || m < 0 || m > INT_MAX)
+		{
+			fprintf(stderr, "-%s: %s: ambiguous redirect\n", sysname, r->target);
+			return -1;
+		}
+		if (fcntl(m, F_GETFD) == -1 || (m != r->fd && dup2(m, r->fd) == -1))
+		{
+			fprintf(stderr, "-%s: %ld: %s\n", sysname, m, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	}
+	if (fd == -1)
+	{
+		fprintf(stderr, "-%s: %s: %s\n", sysname, r->target, strerror(errno));
+		return -1;
+	}
+	if (fd == r->fd)
+		fcntl(fd, F_SETFD, 0); // keep it across exec
+	else
+	{
+		dup2(fd, r->fd);
+		close(fd);
+	}
+	return 0;
+}
+
+/*
+ * Copies everything from in to out inside the kernel when possible:
+ * copy_file_range between files, sendfile from a file, splice when
+ * either side is a pipe, and a plain read/write loop otherwise.
+ */
+int copy_fd(int in, int out)
+{
+	ssize_t n;
+	while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+	if (n == 0)
+		return 0;
+	while ((n = sendfile(out, in, NULL, 1 << 30)) > 0);
+	if (n == 0)
+		return 0;
+	while ((n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE)) > 0);
+	if (n == 0)
+		return 0;
+
+	char buf[65536];
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+		for (ssize_t done = 0; done < n;)
+		{
+			ssize_t w = write(out, buf + done, n - done);
+			if (w < 0)
+				return -1;
+			done += w;
+		}
+	return n < 0 ? -1 : 0;
+}
+
+/*
+ * cat without options is done by the forked child itself, so
+ * redirected files are copied without going through userspace
+ */
+bool is_plain_cat(struct command_t* command)
+{
+	if (strcmp(command->name, "cat") != 0)
+		return false;
+	for (int i = 0; i < command->arg_count; i++)
+		if (command->args[i][0] == '-' && command->args[i][1] != '\0')
+			return false;
+	return true;
+}
+
+int cat(struct command_t* command)
+{
+	fflush(stdout);
+	last_status = 0;
+	if (command->arg_count == 0 && copy_fd(0, 1) == -1)
+	{
+		fprintf(stderr, "-%s: cat: %s\n", sysname, strerror(errno));
+		last_status = 1;
+	}
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		bool is_stdin = strcmp(command->args[i], "-") == 0;
+		int fd = is_stdin ? 0 : open(command->args[i], O_RDONLY | O_CLOEXEC);
+		if (fd == -1 || copy_fd(fd, 1) == -1)
+		{
+			fprintf(stderr, "-%s: cat: %s: %s\n", sysname, command->args[i], strerror(errno));
+			last_status = 1;
+		}
+		if (fd > 0)
+			close(fd);
 	}
 	return SUCCESS;
 }
 
-int shortdirDelete(char* n) {
-	fp = fopen(name, "r");
-	if (!fp) {
-		fp = fopen(name, "w");
+/**
+ * Replaces the current (child) process with the command, applying its
+ * redirections first. Never returns.
+ * @param command [description]
+ */
+void exec_command(struct command_t* command)
+{
+	if (strcmp(command->name, "goodMorning") == 0)
+	{
+		char* time = command->args[0];
+
+		FILE* fp = fopen("command.txt", "w");
+
+		char* hour = strtok(command->args[0], ".");
+		char* minute = strtok(NULL, ".");
+
+		fputs(minute, fp);
+		fputs(" ", fp);
+		fputs(hour, fp);
+		fputs(" * * * XDG_RUNTIME_DIR=/run/user/$(id -u) rhythmbox-client ", fp);
+		fputs(command->args[1], fp);
+		fputs(" --play\n", fp);
 		fclose(fp);
-		fp = fopen(name, "r");
+
+		char** argss;
+		argss = (char**)malloc(sizeof(char*) * 3 + sizeof(char) * 100 * 3);
+		char* ptr = (char*)(argss + 100);
+
+		for (int i = 0; i < 3; i++) {
+			argss[i] = (ptr + 100 * i);
+		}
+
+		strcpy(argss[0], "crontab");
+		strcpy(argss[1], "command.txt");
+		argss[2] = NULL;
+
+		execvp("crontab", argss);
 	}
-	fp2 = fopen(name2, "w");
-	if (!fp2)
-		perror("fopen");
 
-	char line[100];
-	while (fgets(line, 100, fp)) {
-		char l2[100];
-		strcpy(l2, line);
-		char* token = strtok(l2, ":");
-		if (strcmp(token, n) != 0) {
-			fputs(line, fp2);
+	for (int i = 0; i < command->redirect_count; i++)
+		if (apply_redirect(&command->redirects[i]) == -1)
+			_exit(1);
+	if (command->name[0] == '\0') // only redirections: "< src > dst" copies
+	{
+		bool in = false, out = false;
+		for (int i = 0; i < command->redirect_count; i++)
+		{
+			in |= command->redirects[i].fd == 0;
+			out |= command->redirects[i].fd == 1;
+		}
+		if (in && out && copy_fd(0, 1) == -1)
+		{
+			fprintf(stderr, "-%s: %s\n", sysname, strerror(errno));
+			_exit(1);
 		}
+		_exit(0);
+	}
+	if (is_plain_cat(command))
+	{
+		cat(command);
+		_exit(last_status);
 	}
-	fclose(fp);
-	fclose(fp2);
 
-	fp = fopen(name, "w");
-	if (!fp)
-		perror("fopen");
-	fp2 = fopen(name2, "r");
-	if (!fp) {
-		fp2 = fopen(name2, "w");
-		fclose(fp);
-		fp2 = fopen(name2, "r");
+	// increase args size by 2
+	command->args = (char**)realloc(
+		command->args, sizeof(char*) * (command->arg_count += 2));
+
+	// shift everything forward by 1
+	for (int i = command->arg_count - 2;i > 0;--i)
+		command->args[i] = command->args[i - 1];
+
+	// set args[0] as a copy of name
+	command->args[0] = strdup(command->name);
+	// set args[arg_count-1] (last) to NULL
+	command->args[command->arg_count - 1] = NULL;
+
+	char* pth = "/bin/";
+	int size = strlen(pth) + strlen(command->name) + 1;
+
+	char path[size];
+	strcpy(path, pth);
+	strcat(path, command->name);
+	path[size - 1] = '\0';
+
+	execv(path, command->args);
+	// stderr: stdout may already be redirected to a file
+	fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+	_exit(127);
+}
+
+const char* builtins[] = { "exit", "cd", "shortdir", "kdiff", "highlight", "donkey_say", "game", "pipestat", "memo", NULL };
+
+bool is_builtin(struct command_t* command)
+{
+	for (int i = 0; builtins[i]; i++)
+		if (strcmp(builtins[i], command->name) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Runs a builtin with its redirections applied to the shell itself and
+ * undone afterwards
+ */
+int run_redirected(struct command_t* command)
+{
+	int count = command->redirect_count;
+	int saved[count];
+	int applied = 0;
+	int r = SUCCESS;
+
+	fflush(stdout);
+	fflush(stderr);
+	for (; applied < count; applied++)
+	{
+		struct redirect_t* rd = &command->redirects[applied];
+		saved[applied] = fcntl(rd->fd, F_DUPFD_CLOEXEC, 10); // -1 if it was closed
+		if (apply_redirect(rd) == -1)
+		{
+			if (saved[applied] != -1)
+				close(saved[applied]);
+			last_status = 1;
+			break;
+		}
 	}
 
-	while (fgets(line, 100, fp2)) {
-		fputs(line, fp);
+	if (applied == count)
+	{
+		struct redirect_t* redirects = command->redirects;
+		command->redirects = NULL;
+		command->redirect_count = 0;
+		r = process_command(command);
+		command->redirects = redirects;
+		command->redirect_count = count;
 	}
-	fclose(fp);
-	fclose(fp2);
 
-	return SUCCESS;
+	fflush(stdout);
+	fflush(stderr);
+	while (applied-- > 0)
+	{
+		int fd = command->redirects[applied].fd;
+		if (saved[applied] == -1)
+			close(fd);
+		else
+		{
+			dup2(saved[applied], fd);
+			close(saved[applied]);
+		}
+	}
+	return r;
 }
 
-int shortdir(int argc, char* argv[]) {
+int process_command(struct command_t* command);
 
-	if (argc == 2) {
-		if (strcmp(argv[0], "set") == 0) {
-			shortdirDelete(argv[1]);
-			getcwd(cwd, sizeof(cwd));
-			fp = fopen(name, "a");
-			if (!fp) {
-				fp = fopen(name, "w");
-				fclose(fp);
-				fp = fopen(name, "a");
-			}
-			char tmp[100];
-			tmp[0] = '\0';
-			strcat(tmp, argv[1]);
-			strcat(tmp, ":");
-			strcat(tmp, cwd);
-			strcat(tmp, "\n");
-			fputs(tmp, fp);
-			fclose(fp);
-			return SUCCESS;
+/*
+ * pipestat: the shell sits between every pair of stages and moves the
+ * data with splice, timing how long each link waited on its producer
+ * (input empty) or on its consumer (output full).
+ */
+struct pipe_link_t {
+	int in; // read end of the upstream stage's stdout
+	int out; // write end of the downstream stage's stdin
+	bool open;
+	bool waiting_output; // last splice stopped on a full downstream pipe
+	uint64_t bytes;
+	uint64_t empty_ns;
+	uint64_t full_ns;
+	uint64_t closed_ns;
+};
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void relay_link(struct pipe_link_t* link)
+{
+	while (1)
+	{
+		ssize_t n = splice(link->in, NULL, link->out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0)
+		{
+			link->bytes += n;
+			continue;
 		}
-		else if (strcmp(argv[0], "jump") == 0) {
-			fp = fopen(name, "r");
-			if (!fp) {
-				fp = fopen(name, "w");
-				fclose(fp);
-				fp = fopen(name, "r");
-			}
-			char line[100];
-
-			while (fgets(line, 100, fp)) {
-				char* token = strtok(line, ":");
-				if (strcmp(token, argv[1]) == 0) {
-					token = strtok(NULL, ":");
-					token[strlen(token) - 1] = '\0';
-					chdir(token);
-
-					getcwd(cwd, sizeof(cwd));
-					return SUCCESS;
-				}
-			}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+		{
+			// find out which side stopped us
+			struct pollfd p = { link->in, POLLIN, 0 };
+			poll(&p, 1, 0);
+			link->waiting_output = (p.revents & POLLIN) != 0;
+			return;
+		}
+		// EOF from upstream, or downstream went away (EPIPE)
+		close(link->in);
+		close(link->out);
+		link->open = false;
+		link->closed_ns = monotonic_ns();
+		return;
+	}
+}
 
-			printf("There is no any shortdir called: %s\n", argv[1]);
-			fclose(fp);
-			return SUCCESS;
+void relay_pipeline(struct pipe_link_t* links, int count)
+{
+	struct pollfd* fds = malloc(sizeof(struct pollfd) * count);
+	int* index = malloc(sizeof(int) * count);
+	for (int i = 0; i < count; i++)
+		relay_link(&links[i]);
+	while (1)
+	{
+		int n = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (!links[i].open)
+				continue;
+			fds[n].fd = links[i].waiting_output ? links[i].out : links[i].in;
+			fds[n].events = links[i].waiting_output ? POLLOUT : POLLIN;
+			index[n++] = i;
 		}
-		else if (strcmp(argv[0], "del") == 0) {
-			return shortdirDelete(argv[1]);
+		if (n == 0)
+			break;
+
+		uint64_t start = monotonic_ns();
+		if (poll(fds, n, -1) < 0 && errno != EINTR)
+			break;
+		uint64_t waited = monotonic_ns() - start;
+		for (int k = 0; k < n; k++)
+		{
+			struct pipe_link_t* link = &links[index[k]];
+			if (link->waiting_output)
+				link->full_ns += waited;
+			else
+				link->empty_ns += waited;
+			if (fds[k].revents)
+				relay_link(link);
 		}
 	}
-	else if (argc == 1) {
-		if (strcmp(argv[0], "clear") == 0) {
-			fp = fopen(name, "w");
-			if (!fp)
-				perror("fopen");
-			fclose(fp);
-			return SUCCESS;
+	free(fds);
+	free(index);
+}
+
+void print_pipestat(struct command_t* command, struct pipe_link_t* links, struct rusage* usage, uint64_t start, uint64_t end)
+{
+	int stages = 0, worst = -1;
+	uint64_t worst_ns = 0;
+	for (struct command_t* c = command; c; c = c->next)
+		stages++;
+
+	fprintf(stderr, "pipestat: %d stage%s, %.3f s\n", stages, stages == 1 ? "" : "s", (end - start) / 1e9);
+	struct command_t* c = command;
+	for (int s = 0; s < stages; s++, c = c->next)
+	{
+		double cpu = usage[s].ru_utime.tv_sec + usage[s].ru_stime.tv_sec
+			+ (usage[s].ru_utime.tv_usec + usage[s].ru_stime.tv_usec) / 1e6;
+		fprintf(stderr, "  [%d] %-12s cpu %.3f s", s + 1, c->name, cpu);
+		if (s > 0)
+			fprintf(stderr, ", input empty %.3f s", links[s - 1].empty_ns / 1e9);
+		if (s < stages - 1)
+		{
+			double secs = ((links[s].closed_ns ? links[s].closed_ns : end) - start) / 1e9;
+			fprintf(stderr, ", output full %.3f s, %llu bytes out, %.1f MB/s",
+				links[s].full_ns / 1e9, (unsigned long long)links[s].bytes,
+				secs > 0 ? links[s].bytes / secs / 1e6 : 0.0);
 		}
-		else if (strcmp(argv[0], "list") == 0) {
-			fp = fopen(name, "r");
-			if (!fp) {
-				fp = fopen(name, "w");
-				fclose(fp);
-				fp = fopen(name, "r");
-			}
-			char line[100];
-
-			while (fgets(line, 100, fp)) {
-				char l[100];
-				strcpy(l, line);
-				char* token = strtok(l, ":");
-				printf("%s -> ", token);
-				token = strtok(NULL, ":");
-				printf("%s\n", token);
+		fprintf(stderr, "\n");
+
+		// a slow stage makes its producer wait on a full pipe and its consumer
+		// on an empty one; waits it only passes on from its own neighbours
+		// (a starved stage starves the next one too) are not its fault
+		uint64_t starved = s < stages - 1 ? links[s].empty_ns : 0;
+		uint64_t blocked = s > 0 ? links[s - 1].full_ns : 0;
+		uint64_t inherited = s > 0 && s < stages - 1 ? links[s - 1].empty_ns : 0;
+		starved = starved > inherited ? starved - inherited : 0;
+		inherited = s > 0 && s < stages - 1 ? links[s].full_ns : 0;
+		blocked = blocked > inherited ? blocked - inherited : 0;
+		uint64_t blame = starved + blocked;
+		if (blame > worst_ns)
+		{
+			worst_ns = blame;
+			worst = s;
+		}
+	}
+	c = command;
+	for (int s = 0; s < worst; s++)
+		c = c->next;
+	if (worst >= 0 && stages > 1)
+		fprintf(stderr, "  back-pressure: stage %d (%s) held its neighbours up for %.3f s\n",
+			worst + 1, c->name, worst_ns / 1e9);
+}
+
+/*
+ * Runs command->next chained commands with their stdout/stdin connected.
+ * Without stats the stages are joined by plain pipes; with stats
+ * (pipestat) every link goes through the shell's splice relay.
+ */
+int run_pipeline(struct command_t* command, bool stats)
+{
+	int stages = 0;
+	for (struct command_t* c = command; c; c = c->next)
+		stages++;
+	pid_t* pids = calloc(stages, sizeof(pid_t));
+	struct pipe_link_t* links = calloc(stages, sizeof(struct pipe_link_t));
+	struct rusage* usage = calloc(stages, sizeof(struct rusage));
+	int input = -1; // read end feeding the next stage
+	uint64_t start = monotonic_ns();
+
+	fflush(stdout); // the children must not inherit pending output
+	struct command_t* c = command;
+	for (int s = 0; s < stages; s++, c = c->next)
+	{
+		int to_next[2] = { -1, -1 }, from_shell[2] = { -1, -1 };
+		if (s < stages - 1)
+		{
+			pipe2(to_next, O_CLOEXEC);
+			if (stats)
+			{
+				pipe2(from_shell, O_CLOEXEC);
+				fcntl(to_next[0], F_SETFL, O_NONBLOCK);
+				fcntl(from_shell[1], F_SETFL, O_NONBLOCK);
+				links[s].in = to_next[0];
+				links[s].out = from_shell[1];
+				links[s].open = true;
+			}
+		}
+
+		bool foreground = !command->background || stats;
+		pids[s] = fork();
+		if (pids[s] == 0)
+		{
+			child_setup(pids[0], foreground);
+			if (input >= 0)
+				dup2(input, 0);
+			if (to_next[1] >= 0)
+				dup2(to_next[1], 1);
+			// a builtin stage never execs, so close what O_CLOEXEC would have:
+			// holding a write end of its own input pipe, it would never see EOF
+			int ends[] = { input, to_next[0], to_next[1], from_shell[0], from_shell[1] };
+			for (int k = 0; k < 5; k++)
+				if (ends[k] >= 0)
+					close(ends[k]);
+			for (int k = 0; stats && k < s; k++)
+			{
+				close(links[k].in);
+				close(links[k].out);
+			}
+			if (is_builtin(c))
+			{
+				c->next = NULL;
+				process_command(c);
+				fflush(stdout);
+				_exit(last_status); // exit() would rewind the shell's stdin offset
 			}
-			fclose(fp);
-			return SUCCESS;
+			exec_command(c);
 		}
+		job_start(pids[s], pids[0], foreground);
 
+		if (input >= 0)
+			close(input);
+		if (to_next[1] >= 0)
+			close(to_next[1]);
+		input = stats ? from_shell[0] : to_next[0];
 	}
-	return EXIT;
-}
 
-void compare_bytes(FILE* fp1, FILE* fp2) {
-	unsigned long pos;
-	int c1, c2, bytes, bytes1, bytes2;
-	for (pos = 0;; pos++) {
-		c1 = getc(fp1);
-		c2 = getc(fp2);
-		if (c1 != c2 || c1 == EOF)
-			break;
+	if (stats)
+	{
+		// a consumer that exits early must not take the shell down with SIGPIPE
+		void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+		relay_pipeline(links, stages - 1);
+		signal(SIGPIPE, old_pipe);
 	}
 
-	if (c1 == c2) {
-		printf("The two files are identical\n");
-	}
-	else {
-		for (bytes1 = 0; getc(fp1) != EOF; ++bytes1);
-		for (bytes2 = 0; getc(fp2) != EOF; ++bytes2);
-		bytes = bytes1 > bytes2 ? bytes1 : bytes2;
-		printf("The two files are different in %lu bytes\n", bytes - pos);
-		printf("file1 and file2 differ at position %lu: 0x%X <> 0x%X\n", pos, c1, c2);
-	}
-}
+	if (!command->background || stats)
+		last_status = exit_status(wait_job(pids[0], pids, stages, usage, command));
+	else if (loop.active)
+		jobs_add(pids[0], pids[stages - 1], command_text(command), false);
+	if (stats)
+		print_pipestat(command, links, usage, start, monotonic_ns());
 
-int kdiff(int argc, char* argv[]) {
-	int ff = 1;
-	int sf = 2;
-	int i = 1, j = 1;
-	if (argc == 2) {
-		ff = 0;
-		sf = 1;
-	}
-	char* ext = strchr(argv[ff], '.');
-	if (ext != NULL) {
-		i = strcmp(ext + 1, "txt");
-	}
-	char* ext1 = strchr(argv[sf], '.');
-	if (ext != NULL) {
-		j = strcmp(ext1 + 1, "txt");
-	}
+	free(pids);
+	free(links);
+	free(usage);
+	return SUCCESS;
+}
 
-	if ((i != 0 || j != 0) && strcmp(argv[0], "-b") != 0) {
-		printf("Try again\n");
+/*
+ * pipestat cmd | cmd ...: runs the pipeline through the relay and
+ * reports per-stage throughput and which stage was the bottleneck.
+ */
+int pipestat(struct command_t* command)
+{
+	if (command->arg_count == 0)
+	{
+		printf("Usage: pipestat command [| command]...\n");
 		return SUCCESS;
 	}
-	if (argc >= 2) {
+	free(command->name);
+	command->name = command->args[0];
+	memmove(command->args, command->args + 1, sizeof(char*) * --command->arg_count);
+	return run_pipeline(command, true);
+}
 
-		int counter = 0;
-		int line = 0;
-		if (strcmp(argv[0],"-b") != 0) {
-			if (i == 0 && j == 0) {
-				fp = fopen(argv[ff], "r");
-				fp2 = fopen(argv[sf], "r");
-				if (fp == NULL || fp2 == NULL) {
-					printf("Missing file\n");
-					return SUCCESS;
-				}
-				char line1[100];
-				char line2[100];
-				while (fgets(line1, 100, fp) != NULL && fgets(line2, 100, fp2) != NULL) {
-					line++;
-					if (strcmp(line1, line2) != 0) {
-						printf("%s:Line %d: %s\n", argv[ff], line, line1);
-						printf("%s:Line %d: %s\n", argv[sf], line, line2);
-						counter++;
-					}
-				}
+#define MEMO_MAGIC 0x314f4d45U // "EMO1"
+#define MEMO_MAX_BYTES (64 << 20) // whole store; least recently used go first
 
-				while (fgets(line1, 100, fp) != NULL) {
-					line++;
-					printf("%s:Line %d: %s\n", argv[ff], line, line1);
-					counter++;
-				}
+/*
+ * A memo entry is a memo_header followed by the captured output as
+ * records: one byte naming the stream (1 or 2), a 32-bit length, data.
+ * Replaying the records keeps stdout and stderr interleaved.
+ */
+struct memo_header {
+	uint32_t magic;
+	int32_t status;
+	uint64_t bytes;
+};
 
-				while (fgets(line2, 100, fp2) != NULL) {
-					line++;
-					printf("%s:Line %d: %s\n", argv[sf], line, line2);
-					counter++;
-				}
+void memo_hash_file(uint64_t* h, const char* path)
+{
+	struct stat st;
+	uint64_t id[4] = { 0, 0, 0, 0 };
+	if (stat(path, &st) == 0)
+	{
+		id[0] = st.st_dev;
+		id[1] = st.st_ino;
+		id[2] = st.st_size;
+		id[3] = stat_mtime_ns(&st);
+	}
+	h[0] = hash_bytes((unsigned char*)id, sizeof(id), h[0]);
+	h[1] = hash_bytes((unsigned char*)id, sizeof(id), h[1]);
+}
 
-				if (counter != 0) {
-					printf("%d different lines found\n", counter);
-				}
-				else {
-					printf("The two files are identical\n");
-				}
-				fclose(fp);
-				fclose(fp2);
-			}
-			else {
-				printf("Error on kdiff\n");
-			}
+void memo_hash_string(uint64_t* h, const char* s)
+{
+	h[0] = hash_bytes((const unsigned char*)s, strlen(s) + 1, h[0]);
+	h[1] = hash_bytes((const unsigned char*)s, strlen(s) + 1, h[1] ^ 0x5bd1e995);
+}
+
+/*
+ * Cache key: cwd, every stage's argv and redirections, the identity of
+ * each executable (the shell itself for builtins), the selected
+ * variables and the identity of the declared input files and of every
+ * file read through '<'.
+ */
+void memo_key(struct command_t* command, char** inputs, int input_count, char** vars, int var_count, char* key)
+{
+	uint64_t h[2] = { MEMO_MAGIC, ~(uint64_t)MEMO_MAGIC };
+	char dir[PATH_MAX];
+	if (getcwd(dir, sizeof(dir)))
+		memo_hash_string(h, dir);
+	for (struct command_t* c = command; c; c = c->next)
+	{
+		memo_hash_string(h, c->name);
+		for (int i = 0; i < c->arg_count; i++)
+			memo_hash_string(h, c->args[i]);
+		for (int i = 0; i < c->redirect_count; i++)
+		{
+			char op[32];
+			snprintf(op, sizeof(op), "%d %d", c->redirects[i].type, c->redirects[i].fd);
+			memo_hash_string(h, op);
+			memo_hash_string(h, c->redirects[i].target);
+			if (c->redirects[i].type == REDIRECT_INPUT)
+				memo_hash_file(h, c->redirects[i].target);
 		}
-		else if (strcmp(argv[0], "-b") == 0) {
-			fp = fopen(argv[1], "rb");
-			fp2 = fopen(argv[2], "rb");
-			if (fp == NULL || fp2 == NULL) {
-				printf("Missing file\n");
-				return SUCCESS;
-			}
-			compare_bytes(fp, fp2);
-			fclose(fp);
-			fclose(fp2);
+		if (is_builtin(c))
+			memo_hash_file(h, "/proc/self/exe");
+		else
+		{
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "/bin/%s", c->name);
+			memo_hash_file(h, path);
 		}
+	}
+	for (int i = 0; i < var_count; i++)
+	{
+		memo_hash_string(h, vars[i]);
+		memo_hash_string(h, var_get(var_lookup(vars[i], strlen(vars[i]))));
+	}
+	for (int i = 0; i < input_count; i++)
+	{
+		memo_hash_string(h, inputs[i]);
+		memo_hash_file(h, inputs[i]);
+	}
+	sprintf(key, "%016llx%016llx", (unsigned long long)h[0], (unsigned long long)h[1]);
+}
 
+bool memo_replay(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct memo_header))
+	{
+		close(fd);
+		return false;
+	}
+	unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	struct memo_header* header = (struct memo_header*)map;
+	bool valid = header->magic == MEMO_MAGIC && header->bytes == st.st_size - sizeof(*header);
 
+	// check every record before printing any, so a damaged entry is a miss
+	size_t pos = sizeof(*header);
+	while (valid && pos < (size_t)st.st_size)
+	{
+		uint32_t len = 0;
+		valid = pos + 5 <= (size_t)st.st_size && (map[pos] == 1 || map[pos] == 2);
+		if (valid)
+			memcpy(&len, map + pos + 1, 4);
+		valid = valid && len <= st.st_size - pos - 5;
+		pos += 5 + len;
 	}
-	else {
-		printf("Error on kdiff\n");
+	if (!valid)
+	{
+		munmap(map, st.st_size);
+		return false;
 	}
 
-	return SUCCESS;
+	fflush(stdout);
+	pos = sizeof(*header);
+	while (pos < (size_t)st.st_size)
+	{
+		uint32_t len;
+		int stream = map[pos];
+		memcpy(&len, map + pos + 1, 4);
+		pos += 5;
+		for (uint32_t done = 0; done < len;)
+		{
+			ssize_t n = write(stream, map + pos + done, len - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		pos += len;
+	}
+	last_status = header->status;
+	munmap(map, st.st_size);
+	utimensat(AT_FDCWD, path, NULL, 0); // mtime is the LRU clock
+	return true;
 }
 
-int donkeySay(int argc, char* argv[]) {
-	if (argc < 1) {
-		return SUCCESS;
+struct memo_entry_t {
+	char* path;
+	uint64_t used_ns;
+	off_t size;
+};
+
+int compare_used(const void* a, const void* b)
+{
+	uint64_t x = ((struct memo_entry_t*)a)->used_ns;
+	uint64_t y = ((struct memo_entry_t*)b)->used_ns;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * Drops the least recently used entries until the store fits.
+ */
+void memo_evict()
+{
+	DIR* dir = opendir(name4);
+	struct dirent* entry;
+	struct memo_entry_t* entries = NULL;
+	int count = 0;
+	uint64_t total = 0;
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char path[PATH_MAX + NAME_MAX + 2];
+		struct stat st;
+		size_t len = strlen(entry->d_name);
+		if (len < 5 || strcmp(entry->d_name + len - 5, ".memo") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", name4, entry->d_name);
+		if (stat(path, &st) < 0)
+			continue;
+		entries = realloc(entries, sizeof(struct memo_entry_t) * (count + 1));
+		entries[count].path = strdup(path);
+		entries[count].used_ns = stat_mtime_ns(&st);
+		entries[count++].size = st.st_size;
+		total += st.st_size;
 	}
-	printf(" ____________\n");
-	printf("< %s >\n", argv[0]);
-	printf(" ------------\n");
-	printf("        \\   ^__^\n");
-	printf("         \\  (oo)\\_______\n");
-	printf("            (__)\\       )\\/\\\n");
-	printf("                ||-----||\n");
-	printf("                ||     ||\n");
-	printf("============================\n");
-	printf("COMP304COMP304COMP304COMP304\n");
-	return SUCCESS;
+	closedir(dir);
+
+	qsort(entries, count, sizeof(struct memo_entry_t), compare_used);
+	for (int i = 0; i < count; i++)
+	{
+		if (total > MEMO_MAX_BYTES)
+		{
+			unlink(entries[i].path);
+			total -= entries[i].size;
+		}
+		free(entries[i].path);
+	}
+	free(entries);
 }
 
-int highLowGame(int argc, char* argv[]) {
-	char input[20];
-	memset(input, '\0', sizeof(input));
-	int coin = 50;
-	int bet = 2;
-	srand(time(NULL));
-	int start = 1;
-	int toCompare = rand() % 10 + 1;
-	int compared = 5;
-	while (strcmp(input, "exit\n") != 0 && coin > 0)
+/*
+ * Runs the command with stdout/stderr on pipes, passing everything
+ * through to the terminal while recording it into the store.
+ */
+void memo_record(struct command_t* command, const char* path)
+{
+	int out[2], err[2];
+	char tmp[PATH_MAX + 64];
+	pipe2(out, O_CLOEXEC);
+	pipe2(err, O_CLOEXEC);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
 	{
-		if (strcmp(input, "change bet\n") == 0) {
-			printf("Please enter your desired bet: ");
-			scanf("%d", &bet);
-			printf("Enter your guess: ");
-			scanf("%s", input);
-			coin = coin + bet;
+		child_setup(0, true);
+		dup2(out[1], 1);
+		dup2(err[1], 2);
+		process_command(command);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	job_start(pid, 0, true);
+	close(out[1]);
+	close(err[1]);
+
+	mkdir(name4, 0755);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+	FILE* store = fopen(tmp, "wb");
+	struct memo_header header = { MEMO_MAGIC, 0, 0 };
+	if (store)
+		fwrite(&header, sizeof(header), 1, store);
+
+	struct pollfd fds[2] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 } };
+	int open_count = 2;
+	char buf[65536];
+	while (open_count > 0)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
 		}
-		else {
-			printf("\033[2J\n");
-			if (!start) {
-				printf("The number was %d\n", toCompare);
-			}
-			if (start) {
-				printf("Guess high or low\n");
-				printf("If you guess right, you win 2 coins else you lose 2 coins\n");
-				start = 0;
+		for (int i = 0; i < 2; i++)
+		{
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+			ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+			if (n <= 0)
+			{
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				open_count--;
+				continue;
 			}
-			else if (compared > toCompare && strcmp(input, "high\n") == 0) {
-				printf("You guess right!\n");
-				coin = coin + bet;
+			for (ssize_t done = 0; done < n;)
+			{
+				ssize_t w = write(i + 1, buf + done, n - done);
+				if (w <= 0)
+					break;
+				done += w;
 			}
-			else if (compared < toCompare && strcmp(input, "low\n") == 0) {
-				printf("You guess right!\n");
-				coin = coin + bet;
+			if (store && header.bytes + n + 5 <= MEMO_MAX_BYTES)
+			{
+				unsigned char stream = i + 1;
+				uint32_t len = n;
+				fwrite(&stream, 1, 1, store);
+				fwrite(&len, 4, 1, store);
+				fwrite(buf, 1, n, store);
+				header.bytes += n + 5;
 			}
-			else {
-				if (!start && strcmp(input, "change bet\n") != 0) {
-					printf("You guess wrong!\n");
-					coin = coin - bet;
-				}
+			else if (store)
+			{
+				// too large to keep: stop recording, keep streaming
+				fclose(store);
+				unlink(tmp);
+				store = NULL;
 			}
-			toCompare = compared;
-			compared = rand() % 10 + 1;
-			printf("Coin: %d\n", coin);
-			printf("Bet: %d\n", bet);
+		}
+	}
 
-			printf("Number %d\n", toCompare);
-			printf("Enter your guess: ");
-			fgets(input, 99, stdin);
+	int status = wait_job(pid, &pid, 1, NULL, command);
+	last_status = exit_status(status);
+	if (store == NULL)
+		return;
+	header.status = last_status;
+	rewind(store);
+	fwrite(&header, sizeof(header), 1, store);
+	if (fclose(store) == 0 && WIFEXITED(status))
+		rename(tmp, path);
+	else
+		unlink(tmp);
+	memo_evict();
+}
+
+/*
+ * memo [-i file]... [-e var]... command: replays the stored output and
+ * status of an identical earlier run, or runs the command and stores it.
+ */
+int memo(struct command_t* command)
+{
+	char** inputs = NULL;
+	char** vars = NULL;
+	int input_count = 0, var_count = 0, first = 0;
+	while (first + 1 < command->arg_count
+		&& (strcmp(command->args[first], "-i") == 0 || strcmp(command->args[first], "-e") == 0))
+	{
+		if (command->args[first][1] == 'i')
+		{
+			inputs = realloc(inputs, sizeof(char*) * (input_count + 1));
+			inputs[input_count++] = command->args[first + 1];
 		}
+		else
+		{
+			vars = realloc(vars, sizeof(char*) * (var_count + 1));
+			vars[var_count++] = command->args[first + 1];
+		}
+		first += 2;
 	}
-	if (coin <= 0) {
-		printf("Bankrupt coin: %d\n", coin);
+	if (first >= command->arg_count)
+	{
+		printf("Usage: memo [-i file]... [-e var]... command [| command]...\n");
+		free(inputs);
+		free(vars);
+		return SUCCESS;
 	}
-	printf("End of the Game\n");
-	return SUCCESS;
-}
 
+	// the option words stay alive until the command is freed
+	char** options = malloc(sizeof(char*) * (first + 1));
+	memcpy(options, command->args, sizeof(char*) * first);
+	free(command->name);
+	command->name = command->args[first];
+	command->arg_count -= first + 1;
+	memmove(command->args, command->args + first + 1, sizeof(char*) * command->arg_count);
+
+	// a replay only reproduces stdout and stderr, never the files an
+	// earlier run wrote to
+	bool writes_file = false;
+	for (struct command_t* c = command; c; c = c->next)
+		for (int i = 0; i < c->redirect_count; i++)
+			if (c->redirects[i].type == REDIRECT_OUTPUT || c->redirects[i].type == REDIRECT_APPEND)
+				writes_file = true;
 
+	char key[33], path[PATH_MAX + 40];
+	memo_key(command, inputs, input_count, vars, var_count, key);
+	snprintf(path, sizeof(path), "%s/%s.memo", name4, key);
+	if (writes_file)
+	{
+		fprintf(stderr, "-%s: memo: output redirected to a file cannot be replayed\n", sysname);
+		last_status = 1;
+	}
+	else if (name4[0] == '\0') // no store: just run it
+		process_command(command);
+	else if (!memo_replay(path))
+		memo_record(command, path);
+
+	for (int i = 0; i < first; i++)
+		free(options[i]);
+	free(options);
+	free(inputs);
+	free(vars);
+	return SUCCESS;
+}
 
 int process_command(struct command_t* command)
 {
 	int r;
-	if (strcmp(command->name, "") == 0) return SUCCESS;
+	last_status = 0;
+	if (strcmp(command->name, "pipestat") == 0)
+		return pipestat(command);
+
+	if (strcmp(command->name, "memo") == 0)
+		return memo(command);
+
+	if (command->next != NULL)
+		return run_pipeline(command, false);
+
+	if (command->redirect_count > 0 && is_builtin(command))
+		return run_redirected(command);
+
+	if (strcmp(command->name, "") == 0 && command->redirect_count == 0) return SUCCESS;
 
 	if (strcmp(command->name, "exit") == 0)
 		return EXIT;
@@ -738,7 +4480,10 @@ int process_command(struct command_t* command)
 		{
 			r = chdir(command->args[0]);
 			if (r == -1)
+			{
 				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+				last_status = 1;
+			}
 			return SUCCESS;
 		}
 	}
@@ -768,101 +4513,20 @@ int process_command(struct command_t* command)
 		return highLowGame(command->arg_count, command->args);
 	}
 
-	if (strcmp(command->name, "!!") == 0)
-	{
-		if (old_command == NULL) {
-			printf("No commands on history\n");
-		}
-		else {
-			return process_command(old_command);
-		}
-	}
-
+	fflush(stdout); // the child must not inherit pending output
 	pid_t pid = fork();
 	if (pid == 0) // child
 	{
-
-		if (strcmp(command->name, "goodMorning") == 0)
-		{
-			char* time = command->args[0];
-
-			fp = fopen("command.txt", "w");
-
-			char* hour = strtok(command->args[0], ".");
-			char* minute = strtok(NULL, ".");
-
-			fputs(minute, fp);
-			fputs(" ", fp);
-			fputs(hour, fp);
-			fputs(" * * * XDG_RUNTIME_DIR=/run/user/$(id -u) rhythmbox-client ", fp);
-			fputs(command->args[1], fp);
-			fputs(" --play\n", fp);
-			fclose(fp);
-
-			char** argss;
-			argss = (char**)malloc(sizeof(char*) * 3 + sizeof(char) * 100 * 3);
-			char* ptr = (char*)(argss + 100);
-
-			for (int i = 0; i < 3; i++) {
-				argss[i] = (ptr + 100 * i);
-			}
-
-			strcpy(argss[0], "crontab");
-			strcpy(argss[1], "command.txt");
-			argss[2] = NULL;
-
-			execvp("crontab", argss);
-		}
-
-		if (command->redirects[0] != NULL) {
-			int fd = open(command->redirects[0], O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			dup2(fd, 0);
-			close(fd);
-		}
-		if (command->redirects[1] != NULL) {
-			int fd = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			dup2(fd, 1);
-			close(fd);
-		}
-		else if (command->redirects[2] != NULL) {
-			int fd = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			dup2(fd, 1);
-			close(fd);
-		}
-
-		// increase args size by 2
-		command->args = (char**)realloc(
-			command->args, sizeof(char*) * (command->arg_count += 2));
-
-		// shift everything forward by 1
-		for (int i = command->arg_count - 2;i > 0;--i)
-			command->args[i] = command->args[i - 1];
-
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
-
-		char* pth = "/bin/";
-		int size = strlen(pth) + strlen(command->name) + 1;
-
-		char path[size];
-		strcpy(path, pth);
-		strcat(path, command->name);
-		path[size] = '\0';
-
-		execv(path, command->args);
-		exit(0);
+		child_setup(0, !command->background);
+		exec_command(command);
 	}
 	else
 	{
+		job_start(pid, 0, !command->background);
 		if (!command->background)
-			wait(0); // wait for child process to finish
-
-		if (command->next != NULL) {
-
-			return process_command(command->next);
-		}
+			last_status = exit_status(wait_job(pid, &pid, 1, NULL, command)); // wait for child process to finish
+		else if (loop.active)
+			jobs_add(pid, pid, command_text(command), false);
 		return SUCCESS;
 	}
 